@@ -0,0 +1,164 @@
+#if !defined(_KC868_BOARDS_HPP_)
+#define _KC868_BOARDS_HPP_
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <PCF8574_KC868.hpp>
+
+// Compile-time board topology. A descriptor lists the PCF8574 blocks in
+// channel order with the index of the I2C bus each one sits on, the bus
+// pins and the on-board GPIO assignments; everything the firmware sizes
+// or range-checks is derived from it.
+//
+// The KC868-A16 map is checked against docs/KC868-A16-schematic.pdf, the
+// A8, A32 and A64 ones follow the vendor's pin definition tables. The A4
+// drives its relays and inputs from GPIOs, without PCF8574 expanders, so
+// it cannot be described here. Other variants are added by writing a
+// descriptor with the same members; select one with -DKC868_BOARD=<name>.
+
+namespace kc868 {
+  template<size_t N>
+  using Bytes = uint8_t[N];
+
+  namespace detail {
+    constexpr uint8_t a16_addr_in[] = { 0x22, 0x21 };
+    constexpr uint8_t a16_bus_in[] = { 0, 0 };
+    constexpr uint8_t a16_addr_out[] = { 0x24, 0x25 };
+    constexpr uint8_t a16_bus_out[] = { 0, 0 };
+    constexpr uint8_t a16_sda[] = { GPIO_NUM_4 };
+    constexpr uint8_t a16_scl[] = { GPIO_NUM_5 };
+    // INA1, INA2 (0..20mA) and INA3, INA4 (0..3,3V)
+    constexpr uint8_t a16_analog[] = { GPIO_NUM_36, GPIO_NUM_34, GPIO_NUM_35, GPIO_NUM_39 };
+    // HT1, HT2 and HT3
+    constexpr uint8_t a16_temperature[] = { GPIO_NUM_32, GPIO_NUM_33, GPIO_NUM_14 };
+
+    constexpr uint8_t a8_addr_in[] = { 0x22 };
+    constexpr uint8_t a8_bus_in[] = { 0 };
+    constexpr uint8_t a8_addr_out[] = { 0x24 };
+    constexpr uint8_t a8_bus_out[] = { 0 };
+    constexpr uint8_t a8_sda[] = { GPIO_NUM_4 };
+    constexpr uint8_t a8_scl[] = { GPIO_NUM_15 };
+    // A1, A2 (0..5V)
+    constexpr uint8_t a8_analog[] = { GPIO_NUM_36, GPIO_NUM_39 };
+    // 1-wire T1, T2
+    constexpr uint8_t a8_temperature[] = { GPIO_NUM_14, GPIO_NUM_13 };
+
+    // Second bus: inputs and relays 17..32, with the addresses swapped
+    constexpr uint8_t a32_addr_in[] = { 0x21, 0x22, 0x24, 0x25 };
+    constexpr uint8_t a32_bus_in[] = { 0, 0, 1, 1 };
+    constexpr uint8_t a32_addr_out[] = { 0x24, 0x25, 0x21, 0x22 };
+    constexpr uint8_t a32_bus_out[] = { 0, 0, 1, 1 };
+    constexpr uint8_t a32_sda[] = { GPIO_NUM_4, GPIO_NUM_15 };
+    constexpr uint8_t a32_scl[] = { GPIO_NUM_5, GPIO_NUM_13 };
+    constexpr uint8_t a32_analog[] = { GPIO_NUM_36, GPIO_NUM_39, GPIO_NUM_34, GPIO_NUM_35 };
+    constexpr uint8_t a32_temperature[] = { GPIO_NUM_14 };
+
+    // Inputs on PCF8574 (0x20..0x27), relays on PCF8574A (0x38..0x3F)
+    constexpr uint8_t a64_addr_in[] = { 0x24, 0x25, 0x26, 0x27, 0x20, 0x21, 0x22, 0x23 };
+    constexpr uint8_t a64_bus_in[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    constexpr uint8_t a64_addr_out[] = { 0x3C, 0x3D, 0x3E, 0x3F, 0x38, 0x39, 0x3A, 0x3B };
+    constexpr uint8_t a64_bus_out[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    constexpr uint8_t a64_sda[] = { GPIO_NUM_4 };
+    constexpr uint8_t a64_scl[] = { GPIO_NUM_5 };
+    constexpr uint8_t a64_analog[] = { GPIO_NUM_36, GPIO_NUM_39, GPIO_NUM_34, GPIO_NUM_35 };
+    constexpr uint8_t a64_temperature[] = { GPIO_NUM_14 };
+  }
+
+  struct A16 {
+    static constexpr uint8_t buses = 1;
+    static constexpr uint8_t inputBlocks = 2;
+    static constexpr uint8_t outputBlocks = 2;
+    static constexpr uint8_t analogs = 4;
+    static constexpr uint8_t temperatures = 3;
+
+    static constexpr const Bytes<inputBlocks>& addrIn() { return detail::a16_addr_in; }
+    static constexpr const Bytes<inputBlocks>& busIn() { return detail::a16_bus_in; }
+    static constexpr const Bytes<outputBlocks>& addrOut() { return detail::a16_addr_out; }
+    static constexpr const Bytes<outputBlocks>& busOut() { return detail::a16_bus_out; }
+    static constexpr const Bytes<analogs>& analogPins() { return detail::a16_analog; }
+    static constexpr const Bytes<temperatures>& temperaturePins() { return detail::a16_temperature; }
+    static constexpr uint8_t sda(uint8_t bus) { return detail::a16_sda[bus]; }
+    static constexpr uint8_t scl(uint8_t bus) { return detail::a16_scl[bus]; }
+
+    static constexpr uint8_t txRS485 = GPIO_NUM_13;
+    static constexpr uint8_t rxRS485 = GPIO_NUM_16;
+    static constexpr uint8_t tx433M = GPIO_NUM_15;
+    static constexpr uint8_t rx433M = GPIO_NUM_2;
+  };
+
+  struct A8 {
+    static constexpr uint8_t buses = 1;
+    static constexpr uint8_t inputBlocks = 1;
+    static constexpr uint8_t outputBlocks = 1;
+    static constexpr uint8_t analogs = 2;
+    static constexpr uint8_t temperatures = 2;
+
+    static constexpr const Bytes<inputBlocks>& addrIn() { return detail::a8_addr_in; }
+    static constexpr const Bytes<inputBlocks>& busIn() { return detail::a8_bus_in; }
+    static constexpr const Bytes<outputBlocks>& addrOut() { return detail::a8_addr_out; }
+    static constexpr const Bytes<outputBlocks>& busOut() { return detail::a8_bus_out; }
+    static constexpr const Bytes<analogs>& analogPins() { return detail::a8_analog; }
+    static constexpr const Bytes<temperatures>& temperaturePins() { return detail::a8_temperature; }
+    static constexpr uint8_t sda(uint8_t bus) { return detail::a8_sda[bus]; }
+    static constexpr uint8_t scl(uint8_t bus) { return detail::a8_scl[bus]; }
+
+    // No RS485 transceiver on board, the pins go to the extension header
+    static constexpr uint8_t txRS485 = GPIO_NUM_33;
+    static constexpr uint8_t rxRS485 = GPIO_NUM_32;
+    static constexpr uint8_t tx433M = GPIO_NUM_5;
+    static constexpr uint8_t rx433M = GPIO_NUM_2;
+  };
+
+  // Two I2C buses with 16 inputs and 16 relays each
+  struct A32 {
+    static constexpr uint8_t buses = 2;
+    static constexpr uint8_t inputBlocks = 4;
+    static constexpr uint8_t outputBlocks = 4;
+    static constexpr uint8_t analogs = 4;
+    static constexpr uint8_t temperatures = 1;
+
+    static constexpr const Bytes<inputBlocks>& addrIn() { return detail::a32_addr_in; }
+    static constexpr const Bytes<inputBlocks>& busIn() { return detail::a32_bus_in; }
+    static constexpr const Bytes<outputBlocks>& addrOut() { return detail::a32_addr_out; }
+    static constexpr const Bytes<outputBlocks>& busOut() { return detail::a32_bus_out; }
+    static constexpr const Bytes<analogs>& analogPins() { return detail::a32_analog; }
+    static constexpr const Bytes<temperatures>& temperaturePins() { return detail::a32_temperature; }
+    static constexpr uint8_t sda(uint8_t bus) { return detail::a32_sda[bus]; }
+    static constexpr uint8_t scl(uint8_t bus) { return detail::a32_scl[bus]; }
+
+    static constexpr uint8_t txRS485 = GPIO_NUM_33;
+    static constexpr uint8_t rxRS485 = GPIO_NUM_32;
+    // No 433MHz modules on board, free GPIOs of the extension header
+    static constexpr uint8_t tx433M = GPIO_NUM_12;
+    static constexpr uint8_t rx433M = GPIO_NUM_2;
+  };
+
+  struct A64 {
+    static constexpr uint8_t buses = 1;
+    static constexpr uint8_t inputBlocks = 8;
+    static constexpr uint8_t outputBlocks = 8;
+    static constexpr uint8_t analogs = 4;
+    static constexpr uint8_t temperatures = 1;
+
+    static constexpr const Bytes<inputBlocks>& addrIn() { return detail::a64_addr_in; }
+    static constexpr const Bytes<inputBlocks>& busIn() { return detail::a64_bus_in; }
+    static constexpr const Bytes<outputBlocks>& addrOut() { return detail::a64_addr_out; }
+    static constexpr const Bytes<outputBlocks>& busOut() { return detail::a64_bus_out; }
+    static constexpr const Bytes<analogs>& analogPins() { return detail::a64_analog; }
+    static constexpr const Bytes<temperatures>& temperaturePins() { return detail::a64_temperature; }
+    static constexpr uint8_t sda(uint8_t bus) { return detail::a64_sda[bus]; }
+    static constexpr uint8_t scl(uint8_t bus) { return detail::a64_scl[bus]; }
+
+    static constexpr uint8_t txRS485 = GPIO_NUM_13;
+    static constexpr uint8_t rxRS485 = GPIO_NUM_16;
+    static constexpr uint8_t tx433M = GPIO_NUM_15;
+    static constexpr uint8_t rx433M = GPIO_NUM_2;
+  };
+
+  // Expanders sized by the descriptor, to be built with
+  // Expanders<B> x(B::addrIn(), B::busIn(), B::addrOut(), B::busOut(), wires)
+  template<class Board>
+  using Expanders = PCF8574_KC868<Board::inputBlocks, Board::outputBlocks, Board::buses>;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#if !defined(_GATEWAY_CACHE_HPP_)
+#define _GATEWAY_CACHE_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Downstream read responses of the Modbus gateway, keyed by unit, FC and
+// address range. Each entry lives for the TTL it was stored with; a full
+// cache reuses the entry closest to expiry. Times are millis() values.
+// Not synchronized, the caller serializes access
+template<size_t N, size_t DATA = 253>
+class GatewayCache {
+  public:
+    struct Key {
+      uint8_t unit;
+      uint8_t fc;
+      uint16_t start;
+      uint16_t count;
+    };
+
+    GatewayCache() {
+      for (Entry& e : _entries) {
+        e.len = 0;
+      }
+    }
+    // Response data after id and FC, nullptr if absent or expired
+    const uint8_t* find(const Key& key, uint32_t now, uint16_t& len) {
+      const Entry* e = lookup(key);
+      if ((e != nullptr) && ((int32_t)(e->expires - now) > 0)) {
+        hits += 1;
+        len = e->len;
+        return e->data;
+      }
+      misses += 1;
+      return nullptr;
+    }
+    bool store(const Key& key, uint32_t now, uint16_t ttl, const uint8_t* data, uint16_t len) {
+      if ((ttl == 0) || (len == 0) || (len > DATA)) {
+        return false;
+      }
+      Entry* e = lookup(key);
+      if (e == nullptr) {
+        e = victim();
+      }
+      e->key = key;
+      e->expires = now + ttl;
+      e->len = len;
+      memcpy(e->data, data, len);
+      return true;
+    }
+    void invalidate(uint8_t unit) {
+      for (Entry& e : _entries) {
+        if (e.key.unit == unit) {
+          e.len = 0;
+        }
+      }
+    }
+    static constexpr size_t capacity() {
+      return N;
+    }
+
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+  private:
+    struct Entry {
+      uint32_t expires;
+      Key key;
+      uint16_t len; // 0 = free entry
+      uint8_t data[DATA];
+    };
+
+    Entry* lookup(const Key& key) {
+      for (Entry& e : _entries) {
+        if ((e.len != 0) && (e.key.unit == key.unit) && (e.key.fc == key.fc) &&
+            (e.key.start == key.start) && (e.key.count == key.count)) {
+          return &e;
+        }
+      }
+      return nullptr;
+    }
+    Entry* victim() { // Free, else the first to expire
+      Entry* v = &_entries[0];
+      for (Entry& e : _entries) {
+        if (e.len == 0) {
+          return &e;
+        }
+        if ((int32_t)(e.expires - v->expires) < 0) {
+          v = &e;
+        }
+      }
+      return v;
+    }
+
+    Entry _entries[N];
+};
+
+#endif
@@ -0,0 +1,47 @@
+#if !defined(_I2C_BUS_MOCK_HPP_)
+#define _I2C_BUS_MOCK_HPP_
+
+#include "I2CEngine.hpp"
+#include <string.h>
+
+// In memory PCF8574-like bus for host tests and benchmarks: every present
+// address holds a single byte, writes store it and reads return it
+class I2CBusMock : public I2CBus {
+  public:
+    I2CBusMock() {
+      memset(present, 0, sizeof(present));
+      memset(value, 0xFF, sizeof(value));
+    }
+    void attach(uint8_t addr, uint8_t initial = 0xFF) {
+      present[addr & 0x7F] = true;
+      value[addr & 0x7F] = initial;
+    }
+    void detach(uint8_t addr) {
+      present[addr & 0x7F] = false;
+    }
+    virtual bool write(uint8_t addr, const uint8_t* data, uint8_t len) override {
+      writes += 1;
+      if (!present[addr & 0x7F]) {
+        return false;
+      }
+      if (len > 0) {
+        value[addr & 0x7F] = data[len - 1];
+      }
+      return true;
+    }
+    virtual bool read(uint8_t addr, uint8_t* data, uint8_t len) override {
+      reads += 1;
+      if (!present[addr & 0x7F]) {
+        return false;
+      }
+      memset(data, value[addr & 0x7F], len);
+      return true;
+    }
+
+    bool present[128];
+    uint8_t value[128];
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+};
+
+#endif
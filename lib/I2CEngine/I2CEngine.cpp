@@ -0,0 +1,95 @@
+#include "I2CEngine.hpp"
+
+I2CEngine::I2CEngine(I2CBus& bus) : _bus(bus) {
+  #if defined(ESP32)
+    _queue = xQueueCreate(I2C_ENGINE_QUEUE_LEN, sizeof(I2CTransaction));
+  #endif
+}
+
+I2CEngine::~I2CEngine() {
+  #if defined(ESP32)
+    if (_task != nullptr) {
+      vTaskDelete(_task);
+    }
+    vQueueDelete(_queue);
+  #endif
+}
+
+#if defined(ESP32)
+bool I2CEngine::begin(UBaseType_t priority, BaseType_t core) {
+  if (_task != nullptr) {
+    return true;
+  }
+  return xTaskCreatePinnedToCore(task, "i2c", 3072, this, priority, &_task, core) == pdPASS;
+}
+
+void I2CEngine::task(void* arg) {
+  I2CEngine* self = static_cast<I2CEngine*>(arg);
+  while (true) {
+    self->process(portMAX_DELAY);
+  }
+}
+#endif
+
+bool I2CEngine::submit(const I2CTransaction& t) {
+  bool ok;
+  #if defined(ESP32)
+    ok = xQueueSend(_queue, &t, 0) == pdTRUE;
+  #else
+    std::lock_guard<std::mutex> guard(_lock);
+    ok = _count < I2C_ENGINE_QUEUE_LEN;
+    if (ok) {
+      _ring[(_head + _count) % I2C_ENGINE_QUEUE_LEN] = t;
+      _count += 1;
+    }
+  #endif
+  if (!ok) {
+    dropped = dropped + 1;
+  }
+  return ok;
+}
+
+bool I2CEngine::process(uint32_t waitMs) {
+  I2CTransaction t;
+  #if defined(ESP32)
+    const TickType_t ticks = (waitMs == portMAX_DELAY) ? portMAX_DELAY : pdMS_TO_TICKS(waitMs);
+    if (xQueueReceive(_queue, &t, ticks) != pdTRUE) {
+      return false;
+    }
+  #else
+    (void)waitMs; // Host build never blocks
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      if (_count == 0) {
+        return false;
+      }
+      t = _ring[_head];
+      _head = (_head + 1) % I2C_ENGINE_QUEUE_LEN;
+      _count -= 1;
+    }
+  #endif
+  execute(t);
+  return true;
+}
+
+size_t I2CEngine::pending() {
+  #if defined(ESP32)
+    return uxQueueMessagesWaiting(_queue);
+  #else
+    std::lock_guard<std::mutex> guard(_lock);
+    return _count;
+  #endif
+}
+
+void I2CEngine::execute(I2CTransaction& t) {
+  const uint8_t len = (t.len > I2C_ENGINE_MAX_DATA) ? I2C_ENGINE_MAX_DATA : t.len;
+  const bool ok = t.read ? _bus.read(t.addr, t.data, len) : _bus.write(t.addr, t.data, len);
+  if (ok) {
+    completed = completed + 1;
+  } else {
+    failed = failed + 1;
+  }
+  if (t.done != nullptr) {
+    t.done(t, ok);
+  }
+}
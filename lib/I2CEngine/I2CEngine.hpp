@@ -0,0 +1,93 @@
+#if !defined(_I2C_ENGINE_HPP_)
+#define _I2C_ENGINE_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(ARDUINO)
+  #include <Arduino.h>
+  #include <Wire.h>
+#else
+  #include <mutex>
+#endif
+
+#define I2C_ENGINE_MAX_DATA 4
+#define I2C_ENGINE_QUEUE_LEN 32
+
+// Byte level bus access, implemented over TwoWire on target and by
+// I2CBusMock on host
+class I2CBus {
+  public:
+    virtual ~I2CBus() {}
+    virtual bool write(uint8_t addr, const uint8_t* data, uint8_t len) = 0;
+    virtual bool read(uint8_t addr, uint8_t* data, uint8_t len) = 0;
+};
+
+#if defined(ARDUINO)
+class I2CBusWire : public I2CBus {
+  public:
+    I2CBusWire(TwoWire& wire = Wire) : _wire(wire) {}
+    virtual bool write(uint8_t addr, const uint8_t* data, uint8_t len) override {
+      _wire.beginTransmission(addr);
+      _wire.write(data, len);
+      return _wire.endTransmission() == 0;
+    }
+    virtual bool read(uint8_t addr, uint8_t* data, uint8_t len) override {
+      if (_wire.requestFrom(addr, len) != len) {
+        return false;
+      }
+      for (uint8_t i = 0; i < len; ++i) {
+        data[i] = _wire.read();
+      }
+      return true;
+    }
+  private:
+    TwoWire& _wire;
+};
+#endif
+
+struct I2CTransaction {
+  using Callback = void (*)(const I2CTransaction& t, bool ok);
+
+  uint8_t addr;
+  bool read;
+  uint8_t len;
+  uint8_t data[I2C_ENGINE_MAX_DATA]; // Payload to write or buffer read into
+  uint8_t tag;                       // Free for the submitter (eg. block index)
+  Callback done;                     // Called from the engine context, may be null
+  void* ctx;
+};
+
+// Queued transaction engine: submitters never touch the bus, transactions
+// are executed in order by a dedicated task (or by calling process())
+class I2CEngine {
+  public:
+    I2CEngine(I2CBus& bus);
+    ~I2CEngine();
+    #if defined(ESP32)
+    bool begin(UBaseType_t priority = 3, BaseType_t core = tskNO_AFFINITY);
+    #endif
+    bool submit(const I2CTransaction& t); // false if the queue is full
+    bool process(uint32_t waitMs = 0);   // Executes one queued transaction, false if none
+    size_t pending();
+
+    volatile uint32_t completed = 0;
+    volatile uint32_t failed = 0;
+    volatile uint32_t dropped = 0;
+  private:
+    void execute(I2CTransaction& t);
+
+    I2CBus& _bus;
+    #if defined(ESP32)
+    static void task(void* arg);
+    QueueHandle_t _queue;
+    TaskHandle_t _task = nullptr;
+    #else
+    std::mutex _lock;
+    I2CTransaction _ring[I2C_ENGINE_QUEUE_LEN];
+    size_t _head = 0;
+    size_t _count = 0;
+    #endif
+};
+
+#endif
@@ -0,0 +1,228 @@
+#if !defined(_MODBUS_GATEWAY_HPP_)
+#define _MODBUS_GATEWAY_HPP_
+
+#include <GatewayCache.hpp>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(ESP32)
+  #include <Arduino.h>
+#else
+  #include <chrono>
+  #include <condition_variable>
+  #include <mutex>
+#endif
+
+// Forwards Modbus requests (ADUs starting with unit id and FC, no CRC) to a
+// downstream link and waits for the answer, one wait slot per concurrent
+// caller. Transport::send(request, token) queues the request; the link
+// later hands the answer, or nothing when the slave did not respond, to
+// complete(token, ...) from its own context. The token holds the slot
+// index and a sequence, so a late answer to a wait that already gave up
+// is dropped. Reads are answered from a GatewayCache for the TTL lifetime()
+// gives their range; any write drops the unit's entries
+template<class Transport, size_t N_WAITS, size_t N_CACHE = 16, size_t FRAME = 256>
+class ModbusGateway {
+  static_assert((N_WAITS > 0) && (N_WAITS <= 0xFF), "The slot index is the low token byte");
+  public:
+    using Lifetime = uint16_t (*)(uint8_t unit, uint8_t fc, uint16_t start, uint16_t count);
+    using Cache = GatewayCache<N_CACHE, FRAME - 2>;
+
+    // The link times out by itself after timeoutMs; a wait gives up after
+    // that times every slot, for the requests queued ahead of it
+    ModbusGateway(Transport& transport, uint32_t timeoutMs, Lifetime lifetime)
+      : _transport(transport), _timeout(timeoutMs * (N_WAITS + 1)), _lifetime(lifetime) {
+      for (Wait& w : _waits) {
+        w.busy = false;
+      }
+    }
+
+    // Answer to request (anything with data() and size()) copied into
+    // response, returns its length. 0 when there was no answer: no free
+    // slot, the link refused the request or timed out, or the answer does
+    // not fit in size bytes
+    template<class Request>
+    uint16_t forward(const Request& request, uint8_t* response, uint16_t size) {
+      const uint8_t* adu = request.data();
+      if ((request.size() < 2) || (size < 2)) {
+        return 0;
+      }
+      const uint8_t unit = adu[0];
+      const uint8_t fc = adu[1];
+      const bool read = (fc >= 0x01) && (fc <= 0x04) && (request.size() >= 6);
+      const typename Cache::Key key = { unit, fc, word(adu + 2), word(adu + 4) };
+      const uint16_t ttl = read ? _lifetime(unit, fc, key.start, key.count) : 0;
+      if (ttl) {
+        uint16_t len = 0;
+        lock();
+        const uint8_t* data = _cache.find(key, now(), len);
+        const bool hit = (data != nullptr) && (len + 2 <= size);
+        if (hit) {
+          response[0] = unit;
+          response[1] = fc;
+          memcpy(response + 2, data, len);
+        }
+        unlock();
+        if (hit) {
+          return len + 2;
+        }
+      }
+
+      const uint16_t len = exchange(request, response, size);
+      if (len < 2) {
+        failures.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+      }
+      lock();
+      if (!read) {
+        _cache.invalidate(unit);
+      } else if ((response[1] == fc) && (len > 2)) { // Slave exceptions are not cached
+        _cache.store(key, now(), ttl, response + 2, len - 2);
+      }
+      unlock();
+      return len;
+    }
+
+    // Link context: the answer to token, len 0 when the slave did not respond
+    void complete(uint32_t token, const uint8_t* response, uint16_t len) {
+      Wait& wait = _waits[(token & 0xFF) % N_WAITS];
+      Waker woken = nullptr;
+      lock();
+      if (wait.busy && !wait.done && (wait.token == token)) {
+        wait.len = (len <= wait.size) ? len : 0;
+        if (wait.len != 0) {
+          memcpy(wait.dst, response, wait.len);
+        }
+        wait.done = true;
+        woken = waker(wait);
+      }
+      unlock();
+      if (woken != nullptr) {
+        notify(woken); // A stale wake-up is harmless, sleep() checks done
+      }
+    }
+
+    const Cache& cache() const {
+      return _cache;
+    }
+
+    std::atomic<uint32_t> failures { 0 }; // Forwards that got no answer
+  private:
+    struct Wait {
+      bool busy;
+      bool done;
+      uint32_t token;
+      uint8_t* dst;  // The caller's response buffer, written by complete()
+      uint16_t size;
+      uint16_t len;
+      #if defined(ESP32)
+      TaskHandle_t task;
+      #else
+      std::condition_variable cv;
+      #endif
+    };
+
+    static uint16_t word(const uint8_t* p) {
+      return ((uint16_t)p[0] << 8) | p[1];
+    }
+
+    template<class Request>
+    uint16_t exchange(const Request& request, uint8_t* response, uint16_t size) {
+      Wait* wait = nullptr;
+      lock();
+      for (Wait& w : _waits) {
+        if (!w.busy) {
+          wait = &w;
+          wait->busy = true;
+          wait->done = false;
+          wait->token = (++_sequence << 8) | (uint32_t)(&w - _waits);
+          wait->dst = response;
+          wait->size = size;
+          wait->len = 0;
+          #if defined(ESP32)
+          wait->task = xTaskGetCurrentTaskHandle();
+          #endif
+          break;
+        }
+      }
+      unlock();
+      if (wait == nullptr) {
+        return 0;
+      }
+      if (_transport.send(request, wait->token)) {
+        sleep(*wait);
+      }
+      lock();
+      wait->busy = false; // complete() no longer writes to response
+      const uint16_t len = wait->done ? wait->len : 0;
+      unlock();
+      return len;
+    }
+
+    #if defined(ESP32)
+    void lock() {
+      portENTER_CRITICAL(&_mux);
+    }
+    void unlock() {
+      portEXIT_CRITICAL(&_mux);
+    }
+    static uint32_t now() {
+      return millis();
+    }
+    using Waker = TaskHandle_t;
+    static Waker waker(Wait& wait) {
+      return wait.task;
+    }
+    static void notify(Waker task) {
+      xTaskNotifyGive(task);
+    }
+    void sleep(Wait& wait) {
+      const uint32_t deadline = millis() + _timeout;
+      bool done = false;
+      int32_t left;
+      while (!done && ((left = (int32_t)(deadline - millis())) > 0)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(left));
+        lock();
+        done = wait.done;
+        unlock();
+      }
+    }
+
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+    #else
+    void lock() {
+      _mutex.lock();
+    }
+    void unlock() {
+      _mutex.unlock();
+    }
+    static uint32_t now() {
+      return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    using Waker = std::condition_variable*;
+    static Waker waker(Wait& wait) {
+      return &wait.cv;
+    }
+    static void notify(Waker cv) {
+      cv->notify_one();
+    }
+    void sleep(Wait& wait) {
+      std::unique_lock<std::mutex> guard(_mutex);
+      wait.cv.wait_for(guard, std::chrono::milliseconds(_timeout), [&wait] { return wait.done; });
+    }
+
+    std::mutex _mutex;
+    #endif
+
+    Transport& _transport;
+    const uint32_t _timeout;
+    const Lifetime _lifetime;
+    Wait _waits[N_WAITS];
+    Cache _cache;
+    uint32_t _sequence = 0;
+};
+
+#endif
@@ -1,74 +1,237 @@
-
 #include <Arduino.h>
 #include <Wire.h>
+#include <I2CEngine.hpp>
+#include <ef_queue.hpp>
 
 // Requres to init Wire first with intended pins and speed
+// After attachEngine() all bus traffic is queued to the engine. Engine
+// tasks only post completions to an MPSC queue, which updateInput() and
+// updateOutput() apply, so every other member is owned by the task calling
+// those (single owner, no locks)
+// Blocks may live on N_BUS different buses, each with its own engine, so
+// that scans of different buses run in parallel
+
+namespace pcf8574_kc868 {
+  // Transition of a debounced input
+  struct InputEvent {
+    uint16_t input;
+    bool level;
+    uint32_t time; // micros() when the new level was sampled
+  };
+
+  // Result of a queued transaction, posted by an engine task
+  struct Completion {
+    uint8_t kind;  // Which handler applies it
+    uint8_t block;
+    uint8_t data;
+    bool ok;
+  };
+
+  constexpr size_t pow2(size_t n, size_t p = 2) {
+    return (p >= n) ? p : pow2(n, p * 2);
+  }
+
+  // Per expander diagnostics; after a few consecutive errors a device is
+  // taken offline and only probed again with exponential backoff
+  struct DeviceHealth {
+    uint32_t ok = 0;          // Successful transactions
+    uint32_t errors = 0;      // Failed transactions
+    uint16_t consecutive = 0; // Errors since the last success
+    uint8_t backoff = 0;      // Current backoff exponent
+    bool online = true;
+    unsigned long retryAt = 0;
+  };
+
+  // Copies count bits of src starting at bit srcStart into dst starting at
+  // bit 0 (LSB first, as Modbus packs coils), clearing unused high bits
+  inline void copyBitsOut(uint8_t* dst, const uint8_t* src, size_t srcStart, size_t count) {
+    const uint8_t* p = src + srcStart / 8;
+    const uint8_t shift = srcStart % 8;
+    const size_t bytes = (count + 7) / 8;
+    for (size_t i = 0; i < bytes; ++i) {
+      uint16_t w = p[i];
+      if ((shift != 0) && (count > i * 8 + (8 - shift))) {
+        w |= (uint16_t)p[i + 1] << 8;
+      }
+      dst[i] = (uint8_t)(w >> shift);
+    }
+    if ((count % 8) != 0) {
+      dst[bytes - 1] &= (uint8_t)((1 << (count % 8)) - 1);
+    }
+  }
 
-template<int N_IN, int N_OUT>
+  // Merges count bits of src (from bit 0) into dst starting at bit dstStart
+  inline void copyBitsIn(uint8_t* dst, size_t dstStart, const uint8_t* src, size_t count) {
+    uint8_t* p = dst + dstStart / 8;
+    const uint8_t shift = dstStart % 8;
+    for (size_t i = 0; i * 8 < count; ++i) {
+      const size_t n = ((count - i * 8) < 8) ? (count - i * 8) : 8;
+      const uint16_t mask = (uint16_t)((1 << n) - 1) << shift;
+      const uint16_t w = (uint16_t)src[i] << shift;
+      p[i] = (p[i] & ~(uint8_t)mask) | (uint8_t)(w & mask);
+      if (mask >> 8) {
+        p[i + 1] = (p[i + 1] & ~(uint8_t)(mask >> 8)) | (uint8_t)((w & mask) >> 8);
+      }
+    }
+  }
+}
+
+#if !defined(PCF8574_KC868_EVENTS)
+  #define PCF8574_KC868_EVENTS 64
+#endif
+
+template<int N_IN, int N_OUT, int N_BUS = 1>
 class PCF8574_KC868 {
   public:
     PCF8574_KC868(const uint8_t (&addr_in)[N_IN], const uint8_t (&addr_out)[N_OUT], unsigned long updateInpuInterval = 50, TwoWire& wire = Wire)
-    : _wire(wire), updateInpuInterval(updateInpuInterval) {
-      memcpy(this->addr_in, addr_in, sizeof(this->addr_in));
-      memcpy(this->addr_out, addr_out, sizeof(this->addr_out));
-      memset(this->ins, 0xFF, sizeof(this->ins));
-      memset(this->outs, 0xFF, sizeof(this->outs));
+    : updateInpuInterval(updateInpuInterval) {
+      static_assert(N_BUS == 1, "Multiple buses require per block bus indexes");
+      _wires[0] = &wire;
+      memset(this->bus_in, 0, sizeof(this->bus_in));
+      memset(this->bus_out, 0, sizeof(this->bus_out));
+      init(addr_in, addr_out);
+    }
+    // wires may list more controllers than buses, the first N_BUS are used
+    template<size_t N_WIRES>
+    PCF8574_KC868(const uint8_t (&addr_in)[N_IN], const uint8_t (&bus_in)[N_IN],
+                  const uint8_t (&addr_out)[N_OUT], const uint8_t (&bus_out)[N_OUT],
+                  TwoWire* const (&wires)[N_WIRES], unsigned long updateInpuInterval = 50)
+    : updateInpuInterval(updateInpuInterval) {
+      static_assert(N_WIRES >= N_BUS, "One TwoWire per bus");
+      memcpy(this->_wires, wires, sizeof(this->_wires));
+      memcpy(this->bus_in, bus_in, sizeof(this->bus_in));
+      memcpy(this->bus_out, bus_out, sizeof(this->bus_out));
+      init(addr_in, addr_out);
     }
-    constexpr size_t outputs() {
+    static constexpr size_t buses() {
+      return N_BUS;
+    }
+    static constexpr size_t outputs() {
       return N_OUT * 8;
     }
-    constexpr size_t inputs() {
+    static constexpr size_t inputs() {
       return N_IN * 8;
     }
+    void attachEngine(I2CEngine* engine, uint8_t bus = 0) {
+      if (bus < N_BUS) {
+        _engines[bus] = engine;
+      }
+    }
     bool begin(bool doInitialRead = true) {
       int failures = 0;
 
       // Set in input mode the inputs
       for (uint8_t block = 0; block < N_IN; ++block) {
-        _wire.beginTransmission(addr_in[block]);
-        _wire.write(0xFF);
-        if (_wire.endTransmission() != 0) {
+        if (!ready(healthIn[block]) || !transfer(bus_in[block], addr_in[block], false, 0xFF, DONE_INPUT_MODE, block)) {
           failures += 1;
         }
       }
 
-      failures += flushOutput();
+      failures += flushOutput(true);
       if (doInitialRead) {
         failures += flushInput();
       }
       return failures == 0;
     }
+    // Refresh inputs only when the (open drain, active low) INT line of the
+    // input expanders falls, polling every safetyPollInterval as a fallback
+    void enableInterrupt(uint8_t pin, unsigned long safetyPollInterval = 1000) {
+      this->safetyPollInterval = safetyPollInterval;
+      intPin = pin;
+      inputDirty = true;
+      pinMode(pin, INPUT_PULLUP);
+      attachInterruptArg(digitalPinToInterrupt(pin), onInterrupt, this, FALLING);
+    }
+    void disableInterrupt() {
+      if (intPin >= 0) {
+        detachInterrupt(digitalPinToInterrupt(intPin));
+        intPin = -1;
+      }
+    }
     int updateInput() { // Returns number of write failures, -1 means no action
+      applyCompletions();
+      if (reinitPending) { // A device came back, it may have been power cycled
+        reinitPending = false;
+        return begin(true) ? 0 : 1;
+      }
+      if (intPin >= 0) {
+        const unsigned long elapsed = millis() - lastInputUpdate;
+        // While an input is bouncing keep sampling at the regular interval
+        if (inputDirty || (debouncing && (elapsed >= updateInpuInterval)) || (elapsed >= safetyPollInterval)) {
+          return flushInput();
+        }
+        return -1;
+      }
       if ((millis() - lastInputUpdate) >= updateInpuInterval) {
         return flushInput();
       }
       return -1;
     }
-    int flushOutput() { // Returns number of write failures
+    // Request a flush within flushOutputDelay, so that a burst of writes
+    // results in a single transaction per changed block
+    void scheduleFlushOutput() {
+      scheduleFlushOutput(flushOutputDelay);
+    }
+    // An earlier deadline wins, so a pending retry does not hold back new writes
+    void scheduleFlushOutput(unsigned long delay) {
+      const unsigned long at = millis() + delay;
+      if (!flushOutputPending || ((long)(at - flushOutputAt) < 0)) {
+        flushOutputAt = at;
+        flushOutputPending = true;
+      }
+    }
+    int updateOutput() { // Returns number of write failures, -1 means no action
+      applyCompletions();
+      if (flushOutputPending && ((long)(millis() - flushOutputAt) >= 0)) {
+        return flushOutput();
+      }
+      return -1;
+    }
+    int flushOutput(bool force = false) { // Returns number of write failures, only changed blocks are written unless forced
+      flushOutputPending = false;
       int failures = 0;
 
       for (uint8_t block = 0; block < N_OUT; ++block) {
-        _wire.beginTransmission(addr_out[block]);
-        _wire.write(outs[block]);
-        if (_wire.endTransmission() != 0) {
-          failures += 1;
+        const uint8_t value = outs[block];
+        if (outPending[block] || (!force && (value == outsWritten[block]))) {
+          continue;
+        }
+        if (!ready(healthOut[block]) || !transfer(bus_out[block], addr_out[block], false, value, DONE_OUTPUT, block)) {
+          failures += 1; // Left dirty
         }
       }
 
+      // Dirty blocks are retried with exponential backoff until a flush succeeds
+      if (failures > 0) {
+        scheduleFlushOutput(flushRetryMin << flushRetryShift);
+        if (flushRetryShift < backoffMaxShift) {
+          flushRetryShift += 1;
+        }
+      } else {
+        flushRetryShift = 0;
+      }
       return failures;
     }
     int flushInput() { // Returns number of write failures
       lastInputUpdate = millis();
+      inputDirty = false; // Cleared before reading so an edge during the scan is not lost
+      scanClean = true;
       int failures = 0;
 
       for (uint8_t block = 0; block < N_IN; ++block) {
-        if (_wire.requestFrom(addr_in[block], (uint8_t)1) == (uint8_t)1) {
-          ins[block] = _wire.read();
-        } else {
+        if (inPending[block]) {
+          continue;
+        }
+        if (!ready(healthIn[block]) || !transfer(bus_in[block], addr_in[block], true, 0, DONE_INPUT, block)) {
           failures += 1;
         }
       }
 
+      if (failures > 0) {
+        scanClean = false;
+      } else if (!inputsPending()) {
+        recheckInterrupt();
+      } // Else the completion of the last queued read checks
       return failures;
     }
     bool readInput(int n) {
@@ -77,6 +240,59 @@ class PCF8574_KC868 {
       }
       return ins[n / 8] & _BV(n % 8);
     }
+    // False if any block holding part of the range is offline
+    bool inputsOnline(size_t start, size_t count) const {
+      for (size_t block = start / 8; (block < N_IN) && (block * 8 < start + count); ++block) {
+        if (!healthIn[block].online) {
+          return false;
+        }
+      }
+      return true;
+    }
+    bool outputsOnline(size_t start, size_t count) const {
+      for (size_t block = start / 8; (block < N_OUT) && (block * 8 < start + count); ++block) {
+        if (!healthOut[block].online) {
+          return false;
+        }
+      }
+      return true;
+    }
+    uint8_t addrIn(uint8_t block) const {
+      return addr_in[block];
+    }
+    uint8_t addrOut(uint8_t block) const {
+      return addr_out[block];
+    }
+    bool readInputRaw(int n) {
+      if ((n < 0) || (n >= N_IN * 8)) {
+        return true;
+      }
+      return insRaw[n / 8] & _BV(n % 8);
+    }
+    // An input changes in ins[] only after reading the same new level for
+    // the given number of consecutive samples (0 or 1 means no filtering)
+    void setDebounce(int n, uint8_t samples) {
+      if ((n < 0) || (n >= N_IN * 8)) {
+        return;
+      }
+      if (samples < 1) {
+        samples = 1;
+      } else if (samples > DEBOUNCE_MAX_SAMPLES) {
+        samples = DEBOUNCE_MAX_SAMPLES;
+      }
+      for (uint8_t plane = 0; plane < DEBOUNCE_PLANES; ++plane) {
+        if (samples & _BV(plane)) {
+          dbThreshold[plane][n / 8] |= _BV(n % 8);
+        } else {
+          dbThreshold[plane][n / 8] &= ~_BV(n % 8);
+        }
+      }
+    }
+    void setDebounceMs(int n, unsigned long ms) { // Rounded up to whole sampling intervals
+      const unsigned long interval = (updateInpuInterval > 0) ? updateInpuInterval : 1;
+      const unsigned long samples = (ms + interval - 1) / interval;
+      setDebounce(n, (samples > DEBOUNCE_MAX_SAMPLES) ? DEBOUNCE_MAX_SAMPLES : (uint8_t)samples);
+    }
     bool readOutput(int n) {
       if ((n < 0) || (n >= N_OUT * 8)) {
         return true;
@@ -93,12 +309,253 @@ class PCF8574_KC868 {
         outs[n / 8] &= ~_BV(n % 8);
       }
     }
+    // Bulk access to bit ranges, packed LSB first into (count + 7) / 8 bytes.
+    // Return false, without touching anything, if the range is out of bounds
+    bool readInputs(size_t start, size_t count, uint8_t* packed) {
+      if ((start + count) > inputs()) {
+        return false;
+      }
+      pcf8574_kc868::copyBitsOut(packed, ins, start, count);
+      return true;
+    }
+    bool readOutputs(size_t start, size_t count, uint8_t* packed) {
+      if ((start + count) > outputs()) {
+        return false;
+      }
+      pcf8574_kc868::copyBitsOut(packed, outs, start, count);
+      return true;
+    }
+    bool writeOutputs(size_t start, size_t count, const uint8_t* packed) {
+      if ((start + count) > outputs()) {
+        return false;
+      }
+      pcf8574_kc868::copyBitsIn(outs, start, packed, count);
+      return true;
+    }
     unsigned long updateInpuInterval;
-    uint8_t ins[N_IN];
+    unsigned long flushOutputDelay = 2;
+    unsigned long flushRetryMin = 10; // First retry delay of a failed output flush (ms)
+    uint8_t ins[N_IN];    // Debounced image
+    uint8_t insRaw[N_IN]; // Last read from the expanders
     uint8_t outs[N_OUT];
+    // Every input edge, produced by the owner and drained by a single
+    // consumer; see events.overflows for lost edges
+    eflib::SpscRing<pcf8574_kc868::InputEvent, PCF8574_KC868_EVENTS> events;
+    pcf8574_kc868::DeviceHealth healthIn[N_IN];
+    pcf8574_kc868::DeviceHealth healthOut[N_OUT];
+    uint8_t offlineAfterErrors = 3;  // Consecutive errors before backing off
+    unsigned long backoffMin = 100;  // First retry delay of an offline device (ms)
+    uint8_t backoffMaxShift = 8;     // Retry delay is capped at backoffMin << backoffMaxShift
   private:
-    TwoWire& _wire;
+    static constexpr uint8_t DEBOUNCE_PLANES = 4;
+    static constexpr uint8_t DEBOUNCE_MAX_SAMPLES = (1 << DEBOUNCE_PLANES) - 1;
+    enum Kind : uint8_t { DONE_INPUT_MODE, DONE_INPUT, DONE_OUTPUT };
+
+    TwoWire* _wires[N_BUS];
     uint8_t addr_in[N_IN];
     uint8_t addr_out[N_OUT];
+    uint8_t bus_in[N_IN];
+    uint8_t bus_out[N_OUT];
     unsigned long lastInputUpdate;
+    uint8_t outsWritten[N_OUT]; // Last value acknowledged by each output block
+    unsigned long flushOutputAt = 0;
+    uint8_t flushRetryShift = 0;
+    bool flushOutputPending = false;
+    int8_t intPin = -1;
+    unsigned long safetyPollInterval = 1000;
+    volatile bool inputDirty = true;
+    I2CEngine* _engines[N_BUS] = {};
+    // At most one read per input block and one write per output block are
+    // in flight, plus the input mode writes of begin()
+    eflib::MpscQueue<pcf8574_kc868::Completion, pcf8574_kc868::pow2(2 * N_IN + N_OUT)> completions;
+    bool inPending[N_IN] = {};
+    bool outPending[N_OUT] = {};
+    // Vertical counters: bit b of plane p is bit p of the counter of input b,
+    // so a whole block is filtered with a few bitwise operations
+    uint8_t dbCount[DEBOUNCE_PLANES][N_IN];
+    uint8_t dbThreshold[DEBOUNCE_PLANES][N_IN];
+    bool inPrimed[N_IN] = {};
+    bool debouncing = false;
+    bool reinitPending = false;
+    bool scanClean = true; // No read of the current input scan failed
+
+    void init(const uint8_t (&addr_in)[N_IN], const uint8_t (&addr_out)[N_OUT]) {
+      memcpy(this->addr_in, addr_in, sizeof(this->addr_in));
+      memcpy(this->addr_out, addr_out, sizeof(this->addr_out));
+      memset(this->ins, 0xFF, sizeof(this->ins));
+      memset(this->insRaw, 0xFF, sizeof(this->insRaw));
+      memset(this->outs, 0xFF, sizeof(this->outs));
+      memset(this->outsWritten, 0xFF, sizeof(this->outsWritten));
+      memset(this->dbCount, 0x00, sizeof(this->dbCount));
+      memset(this->dbThreshold, 0x00, sizeof(this->dbThreshold));
+      memset(this->dbThreshold[0], 0xFF, sizeof(this->dbThreshold[0])); // 1 sample, no filtering
+    }
+    bool inputsPending() const {
+      for (uint8_t block = 0; block < N_IN; ++block) {
+        if (inPending[block]) {
+          return true;
+        }
+      }
+      return false;
+    }
+    // INT still asserted after a clean scan means something changed meanwhile
+    void recheckInterrupt() {
+      if (scanClean && (intPin >= 0) && (digitalRead(intPin) == LOW)) {
+        inputDirty = true;
+      }
+    }
+    static void IRAM_ATTR onInterrupt(void* arg) {
+      static_cast<PCF8574_KC868*>(arg)->inputDirty = true;
+    }
+    // Single byte transaction, executed in place or queued to the engine.
+    // Returns false on bus failure (sync) or if it could not be queued (async)
+    bool transfer(uint8_t bus, uint8_t addr, bool read, uint8_t value, Kind kind, uint8_t block) {
+      I2CEngine* engine = _engines[bus];
+      if (engine != nullptr) {
+        I2CTransaction t = { addr, read, 1, { value }, block, onEngineDone<DONE_INPUT_MODE>, this };
+        if (kind == DONE_INPUT) {
+          t.done = onEngineDone<DONE_INPUT>;
+        } else if (kind == DONE_OUTPUT) {
+          t.done = onEngineDone<DONE_OUTPUT>;
+        }
+        bool* pending = (kind == DONE_INPUT) ? &inPending[block] : (kind == DONE_OUTPUT) ? &outPending[block] : nullptr;
+        if (pending != nullptr) {
+          *pending = true;
+        }
+        if (!engine->submit(t)) {
+          if (pending != nullptr) {
+            *pending = false;
+          }
+          return false;
+        }
+        return true;
+      }
+      bool ok;
+      TwoWire& wire = *_wires[bus];
+      if (read) {
+        ok = wire.requestFrom(addr, (uint8_t)1) == (uint8_t)1;
+        if (ok) {
+          value = wire.read();
+        }
+      } else {
+        wire.beginTransmission(addr);
+        wire.write(value);
+        ok = wire.endTransmission() == 0;
+      }
+      complete({ kind, block, value, ok });
+      return ok;
+    }
+    // Runs in the engine task: only hands the result over to the owner
+    template<uint8_t KIND>
+    static void onEngineDone(const I2CTransaction& t, bool ok) {
+      PCF8574_KC868* self = static_cast<PCF8574_KC868*>(t.ctx);
+      self->completions.push({ KIND, t.tag, t.data[0], ok }); // Sized for all in flight, never full
+    }
+    void applyCompletions() {
+      pcf8574_kc868::Completion c;
+      while (completions.pop(c)) {
+        complete(c);
+      }
+    }
+    void complete(const pcf8574_kc868::Completion& c) {
+      switch (c.kind) {
+        case DONE_INPUT_MODE:
+          track(healthIn[c.block], c.ok);
+          break;
+        case DONE_INPUT:
+          track(healthIn[c.block], c.ok);
+          if (c.ok) {
+            debounce(c.block, c.data);
+          } else {
+            scanClean = false;
+          }
+          inPending[c.block] = false;
+          if ((_engines[bus_in[c.block]] != nullptr) && !inputsPending()) {
+            recheckInterrupt(); // Scan finished
+          }
+          break;
+        case DONE_OUTPUT:
+          track(healthOut[c.block], c.ok);
+          if (c.ok) {
+            outsWritten[c.block] = c.data;
+          }
+          outPending[c.block] = false;
+          if ((_engines[bus_out[c.block]] != nullptr) && (outs[c.block] != outsWritten[c.block])) {
+            scheduleFlushOutput(); // Changed (or failed) while in flight
+          }
+          break;
+      }
+    }
+    bool ready(const pcf8574_kc868::DeviceHealth& h) const {
+      return h.online || ((long)(millis() - h.retryAt) >= 0);
+    }
+    void track(pcf8574_kc868::DeviceHealth& h, bool ok) {
+      if (ok) {
+        h.ok += 1;
+        h.consecutive = 0;
+        if (!h.online) {
+          h.online = true;
+          h.backoff = 0;
+          reinitPending = true;
+        }
+        return;
+      }
+      h.errors += 1;
+      if (h.consecutive < UINT16_MAX) {
+        h.consecutive += 1;
+      }
+      if (h.consecutive >= offlineAfterErrors) {
+        if (h.online) {
+          h.online = false;
+        } else if (h.backoff < backoffMaxShift) {
+          h.backoff += 1;
+        }
+        h.retryAt = millis() + (backoffMin << h.backoff);
+      }
+    }
+    void debounce(uint8_t block, uint8_t raw) {
+      insRaw[block] = raw;
+      if (!inPrimed[block]) { // First read is taken as is
+        inPrimed[block] = true;
+        ins[block] = raw;
+        return;
+      }
+      const uint8_t delta = raw ^ ins[block];
+      // Count up lanes that differ from the debounced level, reset the others
+      uint8_t carry = delta;
+      uint8_t differ = 0;
+      for (uint8_t plane = 0; plane < DEBOUNCE_PLANES; ++plane) {
+        const uint8_t c = dbCount[plane][block];
+        dbCount[plane][block] = (c ^ carry) & delta;
+        carry &= c;
+        differ |= dbCount[plane][block] ^ dbThreshold[plane][block];
+      }
+      // Lanes whose counter reached the threshold take the new level
+      const uint8_t toggle = delta & ~differ;
+      ins[block] ^= toggle;
+      if (toggle) {
+        const uint32_t now = micros();
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+          if (toggle & _BV(bit)) {
+            events.push({ (uint16_t)(block * 8 + bit), (bool)(ins[block] & _BV(bit)), now });
+          }
+        }
+      }
+      uint8_t active = 0;
+      for (uint8_t plane = 0; plane < DEBOUNCE_PLANES; ++plane) {
+        dbCount[plane][block] &= ~toggle;
+        active |= dbCount[plane][block];
+      }
+      if (active) {
+        debouncing = true;
+      } else if (debouncing) {
+        bool any = false;
+        for (uint8_t b = 0; b < N_IN && !any; ++b) {
+          for (uint8_t plane = 0; plane < DEBOUNCE_PLANES; ++plane) {
+            any = any || (dbCount[plane][b] != 0);
+          }
+        }
+        debouncing = any;
+      }
+    }
 };
@@ -0,0 +1,90 @@
+#include "RCTransmitter.hpp"
+#include <RCSwitch.h>
+
+#if defined(ESP32)
+static_assert(sizeof(RCSymbol) == sizeof(rmt_item32_t), "RCSymbol must match rmt_item32_t");
+
+RCTransmitter::RCTransmitter(uint8_t pin, rmt_channel_t channel) : _pin(pin), _channel(channel) {
+  _queue = xQueueCreate(RC_TX_QUEUE_LEN, sizeof(RCTransmission));
+}
+
+RCTransmitter::~RCTransmitter() {
+  if (_task != nullptr) {
+    vTaskDelete(_task);
+    rmt_driver_uninstall(_channel);
+  }
+  vQueueDelete(_queue);
+}
+
+bool RCTransmitter::begin(UBaseType_t priority, BaseType_t core) {
+  if (_task != nullptr) {
+    return true;
+  }
+  rmt_config_t config = RMT_DEFAULT_CONFIG_TX((gpio_num_t)_pin, _channel);
+  config.clk_div = 80; // 1us ticks from the 80MHz APB clock
+  config.tx_config.idle_output_en = true;
+  config.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+  if ((rmt_config(&config) != ESP_OK) || (rmt_driver_install(_channel, 0, 0) != ESP_OK)) {
+    return false;
+  }
+  return xTaskCreatePinnedToCore(task, "rc_tx", 2048, this, priority, &_task, core) == pdPASS;
+}
+
+void RCTransmitter::onAir(AirCallback cb, void* ctx) {
+  _onAir = cb;
+  _ctx = ctx;
+}
+
+bool RCTransmitter::submit(const RCTransmission& t) {
+  if (xQueueSend(_queue, &t, 0) != pdTRUE) {
+    dropped = dropped + 1;
+    return false;
+  }
+  return true;
+}
+
+size_t RCTransmitter::pending() {
+  return uxQueueMessagesWaiting(_queue);
+}
+
+void RCTransmitter::task(void* arg) {
+  RCTransmitter* self = static_cast<RCTransmitter*>(arg);
+  RCTransmission t;
+  while (true) {
+    if (xQueueReceive(self->_queue, &t, portMAX_DELAY) == pdTRUE) {
+      if (self->play(t)) {
+        self->sent = self->sent + 1;
+      } else {
+        self->failed = self->failed + 1;
+      }
+    }
+  }
+}
+
+bool RCTransmitter::play(const RCTransmission& t) {
+  RCSwitch::Protocol p;
+  if (!RCSwitch::getProtocol(t.protocol, p)) {
+    return false;
+  }
+  if (t.pulseLength != 0) {
+    p.pulseLength = t.pulseLength;
+  }
+  // The frame is encoded once and replayed, repeats only differ in time
+  const size_t n = rcEncodeFrame(p, t.code, t.bits, _frame, RC_TX_FRAME_SYMBOLS);
+  if (n == 0) {
+    return false;
+  }
+  // Receiver is muted only while we are on air, not while queued
+  if (_onAir != nullptr) {
+    _onAir(true, _ctx);
+  }
+  bool ok = true;
+  for (uint8_t r = 0; ok && (r < t.repeat); ++r) {
+    ok = rmt_write_items(_channel, reinterpret_cast<const rmt_item32_t*>(_frame), n, true) == ESP_OK;
+  }
+  if (_onAir != nullptr) {
+    _onAir(false, _ctx);
+  }
+  return ok;
+}
+#endif
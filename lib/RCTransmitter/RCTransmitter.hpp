@@ -0,0 +1,122 @@
+#if !defined(_RC_TRANSMITTER_HPP_)
+#define _RC_TRANSMITTER_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(ESP32)
+  #include <driver/rmt.h>
+#endif
+
+#define RC_TX_QUEUE_LEN 8
+#define RC_TX_FRAME_SYMBOLS 72 // 32 bits + sync, with room for split long levels
+#define RC_TX_MAX_TICKS 32767  // 15 bit RMT duration field
+
+// One RMT symbol, same layout as rmt_item32_t: level0 for duration0 ticks
+// followed by level1 for duration1 ticks (1 tick = 1us)
+struct RCSymbol {
+  uint32_t duration0 : 15;
+  uint32_t level0 : 1;
+  uint32_t duration1 : 15;
+  uint32_t level1 : 1;
+};
+
+// Fills RCSymbols one level at a time, splitting levels longer than the
+// RMT duration field over several half symbols
+class RCSymbolWriter {
+  public:
+    RCSymbolWriter(RCSymbol* out, size_t max) : _out(out), _max(max) {}
+
+    bool level(bool high, uint32_t us) {
+      while (us > 0) {
+        const uint32_t ticks = (us > RC_TX_MAX_TICKS) ? RC_TX_MAX_TICKS : us;
+        if ((_half / 2) >= _max) {
+          return false;
+        }
+        RCSymbol& s = _out[_half / 2];
+        if ((_half & 1) == 0) {
+          s.duration0 = ticks;
+          s.level0 = high;
+          s.duration1 = 0; // End marker until the second half is written
+          s.level1 = high;
+        } else {
+          s.duration1 = ticks;
+          s.level1 = high;
+        }
+        _half += 1;
+        us -= ticks;
+      }
+      return true;
+    }
+    size_t size() const {
+      return (_half + 1) / 2;
+    }
+  private:
+    RCSymbol* _out;
+    size_t _max;
+    size_t _half = 0;
+};
+
+template<class Protocol, class HighLow>
+static inline bool rcEncodePulse(RCSymbolWriter& w, const Protocol& p, const HighLow& hl) {
+  const bool first = !p.invertedSignal;
+  return w.level(first, (uint32_t)p.pulseLength * hl.high) &&
+         w.level(!first, (uint32_t)p.pulseLength * hl.low);
+}
+
+// Encodes one frame exactly as RCSwitch::send() bit-bangs it: bits MSB
+// first, then the sync pulse. Protocol is RCSwitch::Protocol or any struct
+// with the same fields. Returns the symbol count, 0 if it does not fit
+template<class Protocol>
+static inline size_t rcEncodeFrame(const Protocol& p, uint32_t code, uint8_t bits,
+                                   RCSymbol* out, size_t max) {
+  RCSymbolWriter w(out, max);
+  for (int i = (int)bits - 1; i >= 0; --i) {
+    if (!rcEncodePulse(w, p, (code & (1UL << i)) ? p.one : p.zero)) {
+      return 0;
+    }
+  }
+  return rcEncodePulse(w, p, p.syncFactor) ? w.size() : 0;
+}
+
+struct RCTransmission {
+  uint32_t code;
+  uint8_t bits;
+  uint16_t pulseLength; // 0 = protocol default
+  uint8_t protocol;     // RCSwitch protocol number
+  uint8_t repeat;
+};
+
+#if defined(ESP32)
+// Queued 433MHz transmitter: submit() returns at once, frames are played
+// by the RMT peripheral from a dedicated task that only sleeps on the
+// transmission, so no CPU is spent in delayMicroseconds()
+class RCTransmitter {
+  public:
+    using AirCallback = void (*)(bool onAir, void* ctx); // Called around each transmission
+
+    RCTransmitter(uint8_t pin, rmt_channel_t channel = RMT_CHANNEL_0);
+    ~RCTransmitter();
+    bool begin(UBaseType_t priority = 2, BaseType_t core = tskNO_AFFINITY);
+    void onAir(AirCallback cb, void* ctx = nullptr);
+    bool submit(const RCTransmission& t); // false if the queue is full
+    size_t pending();
+
+    volatile uint32_t sent = 0;
+    volatile uint32_t failed = 0;  // Unknown protocol or frame too long
+    volatile uint32_t dropped = 0;
+  private:
+    bool play(const RCTransmission& t);
+    static void task(void* arg);
+
+    uint8_t _pin;
+    rmt_channel_t _channel;
+    QueueHandle_t _queue = nullptr;
+    TaskHandle_t _task = nullptr;
+    AirCallback _onAir = nullptr;
+    void* _ctx = nullptr;
+    RCSymbol _frame[RC_TX_FRAME_SYMBOLS];
+};
+#endif
+
+#endif
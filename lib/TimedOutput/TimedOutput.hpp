@@ -0,0 +1,219 @@
+#if !defined(_TIMED_OUTPUT_HPP_)
+#define _TIMED_OUTPUT_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace timed_output {
+  struct Step {
+    uint16_t output;
+    bool value;
+    uint32_t delay; // ms after the previous step
+  };
+}
+
+// Pulses, on/off delays and short sequences over any sink offering
+// writeOutput(n, value) and flushOutput(), for outputs 0..N_OUTPUTS-1.
+// Pending writes live in a fixed pool hashed on a timer wheel of N_SLOTS
+// one-tick slots; each timer is also linked in its output's chain, so
+// scheduling, expiring and cancelling cost O(1) per timer regardless of
+// the number of pending timers or slots.
+// Everything fired (or written immediately) in one update() is flushed once.
+template<class Sink, size_t N_TIMERS = 64, size_t N_SLOTS = 256, size_t N_OUTPUTS = 64>
+class TimedOutput {
+  static_assert((N_SLOTS & (N_SLOTS - 1)) == 0, "N_SLOTS must be a power of two");
+  static_assert(N_TIMERS < 0xFFFF, "Timer indexes are 16 bit");
+  static_assert(N_SLOTS < 0xFFFF, "Slot indexes are 16 bit");
+  public:
+    TimedOutput(Sink& sink, uint16_t tickMs = 1) : _sink(sink), _tickMs(tickMs ? tickMs : 1) {
+      for (size_t i = 0; i < N_SLOTS; ++i) {
+        _slots[i] = NONE;
+        _tails[i] = NONE;
+      }
+      for (size_t i = 0; i < N_OUTPUTS; ++i) {
+        _outputs[i] = NONE;
+      }
+      for (size_t i = 0; i < N_TIMERS; ++i) {
+        _timers[i].next = (i + 1 < N_TIMERS) ? (uint16_t)(i + 1) : NONE;
+      }
+      _free = 0;
+    }
+    void begin(unsigned long now) {
+      _lastTick = now;
+    }
+    // pulse, onDelay and offDelay replace whatever is pending for output,
+    // so a retrigger is not cut short by the OFF of an earlier pulse
+    bool pulse(uint16_t output, uint32_t ms) { // On now, off after ms
+      cancel(output);
+      if (!schedule(output, false, ms)) {
+        return false;
+      }
+      write(output, true);
+      return true;
+    }
+    bool onDelay(uint16_t output, uint32_t ms) {
+      cancel(output);
+      return schedule(output, true, ms);
+    }
+    bool offDelay(uint16_t output, uint32_t ms) {
+      cancel(output);
+      return schedule(output, false, ms);
+    }
+    // All steps are scheduled or, if the pool is too small or an output is
+    // out of range, none is
+    bool sequence(const timed_output::Step* steps, size_t count) {
+      if (count > available()) {
+        return false;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        if (steps[i].output >= N_OUTPUTS) {
+          return false;
+        }
+      }
+      uint32_t at = 0;
+      for (size_t i = 0; i < count; ++i) {
+        at += steps[i].delay;
+        if (at == 0) {
+          write(steps[i].output, steps[i].value);
+        } else {
+          schedule(steps[i].output, steps[i].value, at);
+        }
+      }
+      return true;
+    }
+    void cancel(uint16_t output) { // Drops every pending write of output
+      if (output >= N_OUTPUTS) {
+        return;
+      }
+      while (_outputs[output] != NONE) {
+        unlink(_outputs[output]);
+      }
+    }
+    size_t available() const {
+      return N_TIMERS - _used;
+    }
+    size_t pending() const {
+      return _used;
+    }
+    // Advances the wheel to now, returns the number of fired timers
+    size_t update(unsigned long now) {
+      size_t fired = 0;
+      while ((now - _lastTick) >= _tickMs) {
+        _lastTick += _tickMs;
+        _cursor = (_cursor + 1) & (N_SLOTS - 1);
+        uint16_t idx = _slots[_cursor];
+        while (idx != NONE) {
+          Timer& t = _timers[idx];
+          const uint16_t next = t.next;
+          if (t.rounds > 0) {
+            t.rounds -= 1;
+          } else {
+            _sink.writeOutput(t.output, t.value);
+            _dirty = true;
+            fired += 1;
+            unlink(idx);
+          }
+          idx = next;
+        }
+      }
+      if (_dirty) {
+        _dirty = false;
+        _sink.flushOutput();
+      }
+      return fired;
+    }
+
+    uint32_t overflows = 0; // Requests refused because the pool was full
+  private:
+    static constexpr uint16_t NONE = 0xFFFF;
+    struct Timer {
+      uint16_t next;     // Slot list, in firing order (free list when unused)
+      uint16_t prev;
+      uint16_t outNext;  // Output chain, unordered
+      uint16_t outPrev;
+      uint16_t slot;
+      uint16_t output;
+      uint32_t rounds;
+      bool value;
+    };
+
+    void write(uint16_t output, bool value) {
+      _sink.writeOutput(output, value);
+      _dirty = true;
+    }
+    bool schedule(uint16_t output, bool value, uint32_t ms) {
+      if (output >= N_OUTPUTS) {
+        return false;
+      }
+      if (_free == NONE) {
+        overflows += 1;
+        return false;
+      }
+      uint32_t ticks = (ms + _tickMs - 1) / _tickMs;
+      if (ticks == 0) {
+        ticks = 1; // Earliest is the next tick
+      }
+      const uint16_t idx = _free;
+      Timer& t = _timers[idx];
+      _free = t.next;
+      _used += 1;
+      t.output = output;
+      t.value = value;
+      t.rounds = (ticks - 1) / N_SLOTS;
+      t.slot = (uint16_t)((_cursor + ticks) & (N_SLOTS - 1));
+      // Appended, so steps due on the same tick fire in scheduling order
+      t.next = NONE;
+      t.prev = _tails[t.slot];
+      if (t.prev == NONE) {
+        _slots[t.slot] = idx;
+      } else {
+        _timers[t.prev].next = idx;
+      }
+      _tails[t.slot] = idx;
+      t.outPrev = NONE;
+      t.outNext = _outputs[output];
+      if (t.outNext != NONE) {
+        _timers[t.outNext].outPrev = idx;
+      }
+      _outputs[output] = idx;
+      return true;
+    }
+    void unlink(uint16_t idx) { // Out of its slot and output chain, back to the pool
+      Timer& t = _timers[idx];
+      if (t.prev == NONE) {
+        _slots[t.slot] = t.next;
+      } else {
+        _timers[t.prev].next = t.next;
+      }
+      if (t.next == NONE) {
+        _tails[t.slot] = t.prev;
+      } else {
+        _timers[t.next].prev = t.prev;
+      }
+      if (t.outPrev == NONE) {
+        _outputs[t.output] = t.outNext;
+      } else {
+        _timers[t.outPrev].outNext = t.outNext;
+      }
+      if (t.outNext != NONE) {
+        _timers[t.outNext].outPrev = t.outPrev;
+      }
+      t.next = _free;
+      _free = idx;
+      _used -= 1;
+    }
+
+    Sink& _sink;
+    const uint16_t _tickMs;
+    Timer _timers[N_TIMERS];
+    uint16_t _slots[N_SLOTS];
+    uint16_t _tails[N_SLOTS];
+    uint16_t _outputs[N_OUTPUTS]; // Head of each output's chain
+    uint16_t _free;
+    size_t _used = 0;
+    size_t _cursor = 0;
+    unsigned long _lastTick = 0;
+    bool _dirty = false;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#if !defined(_EF_POOL_HPP_)
+#define _EF_POOL_HPP_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace eflib {
+  // Fixed pool of N (max 32) buffers of SIZE bytes, lock-free acquire()
+  // and release() from any task; never allocates
+  template<size_t N, size_t SIZE>
+  class BufferPool {
+    static_assert((N >= 1) && (N <= 32), "N must be 1..32");
+    public:
+      uint8_t* acquire() {
+        uint32_t used = _used.load(std::memory_order_relaxed);
+        while (true) {
+          const uint32_t avail = ~used & mask();
+          if (avail == 0) {
+            exhausted.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+          }
+          const uint32_t bit = avail & (~avail + 1); // Lowest free buffer
+          if (_used.compare_exchange_weak(used, used | bit, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return _buff[__builtin_ctz(bit)];
+          }
+        }
+      }
+      void release(uint8_t* p) {
+        const size_t i = (p - &_buff[0][0]) / SIZE;
+        _used.fetch_and(~(1UL << i), std::memory_order_release);
+      }
+      static constexpr size_t capacity() {
+        return N;
+      }
+      static constexpr size_t bufferSize() {
+        return SIZE;
+      }
+
+      std::atomic<uint32_t> exhausted { 0 }; // acquire() calls that found no free buffer
+    private:
+      static constexpr uint32_t mask() {
+        return (N == 32) ? 0xFFFFFFFFUL : ((1UL << N) - 1);
+      }
+      alignas(4) uint8_t _buff[N][SIZE];
+      std::atomic<uint32_t> _used { 0 };
+  };
+}
+
+#endif
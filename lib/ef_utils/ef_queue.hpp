@@ -0,0 +1,155 @@
+#if !defined(_EF_QUEUE_HPP_)
+#define _EF_QUEUE_HPP_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// For members an IRAM interrupt handler may call: forced inline, so the
+// handler never calls an out of line copy left in flash
+#define EF_ISR_INLINE inline __attribute__((always_inline))
+
+namespace eflib {
+  // Lock-free single producer / single consumer ring of N (power of two)
+  // elements. push() only from the producer and pop() only from the
+  // consumer context; neither blocks nor allocates, either may run in an ISR
+  template<typename T, size_t N>
+  class SpscRing {
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "N must be a power of two");
+    public:
+      EF_ISR_INLINE bool push(const T& v) {
+        const uint32_t head = _head.load(std::memory_order_relaxed);
+        if ((head - _tail.load(std::memory_order_acquire)) >= N) {
+          overflows.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        _buff[head & (N - 1)] = v;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+      }
+      EF_ISR_INLINE bool pop(T& v) {
+        const uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) {
+          return false;
+        }
+        v = _buff[tail & (N - 1)];
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+      EF_ISR_INLINE size_t size() const {
+        return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+      }
+      bool empty() const {
+        return size() == 0;
+      }
+      static constexpr size_t capacity() {
+        return N;
+      }
+
+      std::atomic<uint32_t> overflows { 0 }; // Elements dropped because the ring was full
+    private:
+      T _buff[N];
+      std::atomic<uint32_t> _head { 0 };
+      std::atomic<uint32_t> _tail { 0 };
+  };
+
+  // Bounded lock-free multi producer / single consumer queue (per cell
+  // sequence numbers), push() is safe from any task, pop() from one only
+  template<typename T, size_t N>
+  class MpscQueue {
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "N must be a power of two");
+    public:
+      MpscQueue() {
+        for (size_t i = 0; i < N; ++i) {
+          _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+      }
+      // ticket, if given, receives the position of v: elements are popped
+      // in ticket order, so v has been consumed once ticket + 1 pops happened
+      bool push(const T& v, uint32_t* ticket = nullptr) {
+        Cell* cell;
+        uint32_t pos = _head.load(std::memory_order_relaxed);
+        while (true) {
+          cell = &_cells[pos & (N - 1)];
+          const int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - pos);
+          if (diff == 0) {
+            if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+              break;
+            }
+          } else if (diff < 0) {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+          } else {
+            pos = _head.load(std::memory_order_relaxed);
+          }
+        }
+        cell->data = v;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        if (ticket != nullptr) {
+          *ticket = pos;
+        }
+        return true;
+      }
+      bool pop(T& v) {
+        Cell& cell = _cells[_tail & (N - 1)];
+        if ((int32_t)(cell.seq.load(std::memory_order_acquire) - (_tail + 1)) < 0) {
+          return false;
+        }
+        v = cell.data;
+        cell.seq.store(_tail + N, std::memory_order_release);
+        _tail += 1;
+        return true;
+      }
+
+      std::atomic<uint32_t> overflows { 0 }; // Elements refused because the queue was full
+    private:
+      struct Cell {
+        std::atomic<uint32_t> seq;
+        T data;
+      };
+      Cell _cells[N];
+      std::atomic<uint32_t> _head { 0 };
+      uint32_t _tail = 0;
+  };
+
+  // Single writer sequence lock: readers never block the writer and retry
+  // until they copy a consistent (untorn) value. T must be trivially copyable
+  template<typename T>
+  class SeqLock {
+    public:
+      void write(const T& v) {
+        const uint32_t seq = _seq.load(std::memory_order_relaxed);
+        _seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy((void*)&_data, &v, sizeof(T));
+        _seq.store(seq + 2, std::memory_order_release);
+      }
+      // Calls wait() between retries, so a reader preempting the writer
+      // on the same core can give it the CPU back (eg. vTaskDelay(1))
+      template<typename W>
+      void read(T& v, W wait) const {
+        for (uint32_t attempt = 1; ; ++attempt) {
+          const uint32_t seq = _seq.load(std::memory_order_acquire);
+          if ((seq & 1) == 0) {
+            memcpy(&v, (const void*)&_data, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (_seq.load(std::memory_order_relaxed) == seq) {
+              return;
+            }
+          }
+          if ((attempt % 16) == 0) {
+            wait();
+          }
+        }
+      }
+      uint32_t version() const { // Number of completed writes
+        return _seq.load(std::memory_order_acquire) / 2;
+      }
+    private:
+      T _data;
+      std::atomic<uint32_t> _seq { 0 };
+  };
+}
+
+#endif
@@ -21,7 +21,7 @@ void printRC(Print& device, bool raw_data, uint32_t code, uint16_t length,
   device.print(delay);
   device.print(F(", Protocol="));
   device.println(protocol);
-  if (raw_data) {
+  if (raw_data && (raw != nullptr)) { // nullptr unless the receiver keeps timings
     device.print(F("Raw data: "));
     for (uint16_t i = 0; i <= length * 2; i++) {
       if (i != 0) device.print(F(","));
@@ -54,6 +54,13 @@
     #define VAR_ISR_ATTR
 #endif
 
+#if defined(RCSWITCH_QUEUED_DECODE)
+    #define DECODE_ATTR
+#else
+    // Decoding runs in the ISR
+    #define DECODE_ATTR RECEIVE_ATTR
+#endif
+
 
 /* Format for protocol definitions:
  * {pulselength, Sync bit, "0" bit, "1" bit, invertedSignal}
@@ -98,16 +105,10 @@ enum {
 };
 
 #if not defined( RCSwitchDisableReceiving )
-volatile unsigned long RCSwitch::nReceivedValue = 0;
-volatile unsigned int RCSwitch::nReceivedBitlength = 0;
-volatile unsigned int RCSwitch::nReceivedDelay = 0;
-volatile unsigned int RCSwitch::nReceivedProtocol = 0;
-int RCSwitch::nReceiveTolerance = 60;
 const unsigned int RCSwitch::nSeparationLimit = 4300;
 // separationLimit: minimum microseconds between received codes, closer codes are ignored.
 // according to discussion on issue #14 it might be more suitable to set the separation
 // limit to the same time as the 'low' part of the sync signal for the current protocol.
-unsigned int RCSwitch::timings[RCSWITCH_MAX_CHANGES];
 #endif
 
 RCSwitch::RCSwitch() {
@@ -117,7 +118,17 @@ RCSwitch::RCSwitch() {
   #if not defined( RCSwitchDisableReceiving )
   this->nReceiverInterrupt = -1;
   this->setReceiveTolerance(60);
-  RCSwitch::nReceivedValue = 0;
+  this->received = {};
+  this->keepRawdata = false;
+  #if defined(RCSWITCH_QUEUED_DECODE)
+  this->rawSlot = 0;
+  #endif
+  this->changeCount = 0;
+  this->repeatCount = 0;
+  this->lastTime = 0;
+  #if defined(ESP32)
+  this->decoder = nullptr;
+  #endif
   #endif
 }
 
@@ -151,6 +162,21 @@ void RCSwitch::setProtocol(int nProtocol, int nPulseLength) {
 }
 
 
+/**
+  * Copies the timing of a predefined protocol, false if nProtocol is unknown.
+  */
+bool RCSwitch::getProtocol(int nProtocol, Protocol& protocol) {
+  if (nProtocol < 1 || nProtocol > numProto) {
+    return false;
+  }
+#if defined(ESP8266) || defined(ESP32)
+  protocol = proto[nProtocol-1];
+#else
+  memcpy_P(&protocol, &proto[nProtocol-1], sizeof(Protocol));
+#endif
+  return true;
+}
+
 /**
   * Sets pulse length in microseconds
   */
@@ -170,7 +196,7 @@ void RCSwitch::setRepeatTransmit(int nRepeatTransmit) {
  */
 #if not defined( RCSwitchDisableReceiving )
 void RCSwitch::setReceiveTolerance(int nPercent) {
-  RCSwitch::nReceiveTolerance = nPercent;
+  this->nReceiveTolerance = nPercent;
 }
 #endif
   
@@ -553,16 +579,36 @@ void RCSwitch::enableReceive(int interrupt) {
 
 void RCSwitch::enableReceive() {
   if (this->nReceiverInterrupt != -1) {
-    RCSwitch::nReceivedValue = 0;
-    RCSwitch::nReceivedBitlength = 0;
-#if defined(RaspberryPi) // Raspberry Pi
-    wiringPiISR(this->nReceiverInterrupt, INT_EDGE_BOTH, &handleInterrupt);
-#else // Arduino
-    attachInterrupt(this->nReceiverInterrupt, handleInterrupt, CHANGE);
+    this->received.value = 0;
+    this->received.bitlength = 0;
+    this->resumeReceive();
+  }
+}
+
+void RCSwitch::resumeReceive() {
+  if (this->nReceiverInterrupt != -1) {
+#if defined(RCSWITCH_ISR_ARG)
+    attachInterruptArg(this->nReceiverInterrupt, handleInterrupt, this, CHANGE);
+#else
+    // No ISR argument, so only one receiver
+    RCSwitch::isrReceiver = this;
+  #if defined(RaspberryPi) // Raspberry Pi
+    wiringPiISR(this->nReceiverInterrupt, INT_EDGE_BOTH, &handleSingleInterrupt);
+  #else // Arduino
+    attachInterrupt(this->nReceiverInterrupt, handleSingleInterrupt, CHANGE);
+  #endif
 #endif
   }
 }
 
+void RCSwitch::pauseReceive() {
+#if not defined(RaspberryPi) // Arduino
+  if (this->nReceiverInterrupt != -1) {
+    detachInterrupt(this->nReceiverInterrupt);
+  }
+#endif
+}
+
 /**
  * Disable receiving data
  */
@@ -574,31 +620,70 @@ void RCSwitch::disableReceive() {
 }
 
 bool RCSwitch::available() {
-  return RCSwitch::nReceivedValue != 0;
+#if defined(RCSWITCH_QUEUED_DECODE)
+  if (this->received.value == 0) {
+  #if defined(ESP32)
+    if (this->decoder == nullptr) {
+      this->decode();
+    }
+  #else
+    this->decode();
+  #endif
+    this->results.pop(this->received);
+  }
+#endif
+  return this->received.value != 0;
 }
 
 void RCSwitch::resetAvailable() {
-  RCSwitch::nReceivedValue = 0;
+  this->received.value = 0;
 }
 
 unsigned long RCSwitch::getReceivedValue() {
-  return RCSwitch::nReceivedValue;
+  return this->received.value;
 }
 
 unsigned int RCSwitch::getReceivedBitlength() {
-  return RCSwitch::nReceivedBitlength;
+  return this->received.bitlength;
 }
 
 unsigned int RCSwitch::getReceivedDelay() {
-  return RCSwitch::nReceivedDelay;
+  return this->received.delay;
 }
 
 unsigned int RCSwitch::getReceivedProtocol() {
-  return RCSwitch::nReceivedProtocol;
+  return this->received.protocol;
 }
 
 unsigned int* RCSwitch::getReceivedRawdata() {
-  return RCSwitch::timings;
+  if (!this->keepRawdata) {
+    return nullptr;
+  }
+#if defined(RCSWITCH_QUEUED_DECODE)
+  return this->rawdata[this->received.raw];
+#else
+  return this->timings; // As rc-switch, overwritten by the next edges
+#endif
+}
+
+void RCSwitch::setReceiveRawdata(bool keep) {
+  this->keepRawdata = keep;
+}
+
+uint32_t RCSwitch::getLostEdges() {
+#if defined(RCSWITCH_QUEUED_DECODE)
+  return this->edges.overflows;
+#else
+  return 0;
+#endif
+}
+
+uint32_t RCSwitch::getLostCodes() {
+#if defined(RCSWITCH_QUEUED_DECODE)
+  return this->results.overflows;
+#else
+  return 0; // Overwritten instead, as in rc-switch
+#endif
 }
 
 /* helper function for the receiveProtocol method */
@@ -609,7 +694,7 @@ static inline unsigned int diff(int A, int B) {
 /**
  *
  */
-bool RECEIVE_ATTR RCSwitch::receiveProtocol(const int p, unsigned int changeCount) {
+bool DECODE_ATTR RCSwitch::receiveProtocol(const int p, unsigned int changeCount) {
 #if defined(ESP8266) || defined(ESP32)
     const Protocol &pro = proto[p-1];
 #else
@@ -620,8 +705,8 @@ bool RECEIVE_ATTR RCSwitch::receiveProtocol(const int p, unsigned int changeCoun
     unsigned long code = 0;
     //Assuming the longer pulse length is the pulse captured in timings[0]
     const unsigned int syncLengthInPulses =  ((pro.syncFactor.low) > (pro.syncFactor.high)) ? (pro.syncFactor.low) : (pro.syncFactor.high);
-    const unsigned int delay = RCSwitch::timings[0] / syncLengthInPulses;
-    const unsigned int delayTolerance = delay * RCSwitch::nReceiveTolerance / 100;
+    const unsigned int delay = this->timings[0] / syncLengthInPulses;
+    const unsigned int delayTolerance = delay * this->nReceiveTolerance / 100;
     
     /* For protocols that start low, the sync period looks like
      *               _________
@@ -644,11 +729,11 @@ bool RECEIVE_ATTR RCSwitch::receiveProtocol(const int p, unsigned int changeCoun
 
     for (unsigned int i = firstDataTiming; i < changeCount - 1; i += 2) {
         code <<= 1;
-        if (diff(RCSwitch::timings[i], delay * pro.zero.high) < delayTolerance &&
-            diff(RCSwitch::timings[i + 1], delay * pro.zero.low) < delayTolerance) {
+        if (diff(this->timings[i], delay * pro.zero.high) < delayTolerance &&
+            diff(this->timings[i + 1], delay * pro.zero.low) < delayTolerance) {
             // zero
-        } else if (diff(RCSwitch::timings[i], delay * pro.one.high) < delayTolerance &&
-                   diff(RCSwitch::timings[i + 1], delay * pro.one.low) < delayTolerance) {
+        } else if (diff(this->timings[i], delay * pro.one.high) < delayTolerance &&
+                   diff(this->timings[i + 1], delay * pro.one.low) < delayTolerance) {
             // one
             code |= 1;
         } else {
@@ -658,55 +743,127 @@ bool RECEIVE_ATTR RCSwitch::receiveProtocol(const int p, unsigned int changeCoun
     }
 
     if (changeCount > 7) {    // ignore very short transmissions: no device sends them, so this must be noise
-        RCSwitch::nReceivedValue = code;
-        RCSwitch::nReceivedBitlength = (changeCount - 1) / 2;
-        RCSwitch::nReceivedDelay = delay;
-        RCSwitch::nReceivedProtocol = p;
+        Received r = {};
+        r.value = code;
+        r.bitlength = (changeCount - 1) / 2;
+        r.delay = delay;
+        r.protocol = p;
+#if defined(RCSWITCH_QUEUED_DECODE)
+        const bool raw = this->keepRawdata;
+        if (raw) {
+          r.raw = this->rawSlot;
+          memcpy(this->rawdata[r.raw], this->timings, sizeof(this->timings));
+        }
+        // Counted in getLostCodes() when full; the slot is only taken once queued
+        if (this->results.push(r) && raw) {
+          this->rawSlot = (this->rawSlot + 1) % (RCSWITCH_RESULT_QUEUE + 2);
+        }
+#else
+        this->received = r;
+#endif
         return true;
     }
 
     return false;
 }
 
-void RECEIVE_ATTR RCSwitch::handleInterrupt() {
+/**
+ * Only measures the time since the previous edge when decoding is queued:
+ * the protocol matching runs in decode() outside of interrupt context
+ */
+void RECEIVE_ATTR RCSwitch::handleInterrupt(void* arg) {
+  RCSwitch* self = static_cast<RCSwitch*>(arg);
+
+  const unsigned long time = micros();
+  const unsigned int duration = time - self->lastTime;
+  self->lastTime = time;
+#if defined(RCSWITCH_QUEUED_DECODE)
+  self->edges.push(duration);
+  #if defined(ESP32)
+  // The decoder task is woken when a frame may have ended (a gap) or the
+  // ring fills up, not for every edge
+  if ((self->decoder != nullptr) &&
+      ((duration > RCSwitch::nSeparationLimit) || (self->edges.size() >= RCSWITCH_EDGE_RING / 2))) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(self->decoder, &woken);
+    if (woken == pdTRUE) {
+      portYIELD_FROM_ISR();
+    }
+  }
+  #endif
+#else
+  self->decodeEdge(duration);
+#endif
+}
+
+#if !defined(RCSWITCH_ISR_ARG)
+RCSwitch* RCSwitch::isrReceiver = nullptr;
 
-  static unsigned int changeCount = 0;
-  static unsigned long lastTime = 0;
-  static unsigned int repeatCount = 0;
+void RECEIVE_ATTR RCSwitch::handleSingleInterrupt() {
+  handleInterrupt(RCSwitch::isrReceiver);
+}
+#endif
 
-  const long time = micros();
-  const unsigned int duration = time - lastTime;
+void RCSwitch::decode() {
+#if defined(RCSWITCH_QUEUED_DECODE)
+  unsigned int duration;
+  while (this->edges.pop(duration)) {
+    this->decodeEdge(duration);
+  }
+#endif
+}
 
+void DECODE_ATTR RCSwitch::decodeEdge(unsigned int duration) {
   if (duration > RCSwitch::nSeparationLimit) {
     // A long stretch without signal level change occurred. This could
     // be the gap between two transmission.
-    if ((repeatCount==0) || (diff(duration, RCSwitch::timings[0]) < 200)) {
+    if ((this->repeatCount==0) || (diff(duration, this->timings[0]) < 200)) {
       // This long signal is close in length to the long signal which
       // started the previously recorded timings; this suggests that
       // it may indeed by a a gap between two transmissions (we assume
       // here that a sender will send the signal multiple times,
       // with roughly the same gap between them).
-      repeatCount++;
-      if (repeatCount == 2) {
+      this->repeatCount++;
+      if (this->repeatCount == 2) {
         for(unsigned int i = 1; i <= numProto; i++) {
-          if (receiveProtocol(i, changeCount)) {
+          if (this->receiveProtocol(i, this->changeCount)) {
             // receive succeeded for protocol i
             break;
           }
         }
-        repeatCount = 0;
+        this->repeatCount = 0;
       }
     }
-    changeCount = 0;
+    this->changeCount = 0;
   }
- 
+
   // detect overflow
-  if (changeCount >= RCSWITCH_MAX_CHANGES) {
-    changeCount = 0;
-    repeatCount = 0;
+  if (this->changeCount >= RCSWITCH_MAX_CHANGES) {
+    this->changeCount = 0;
+    this->repeatCount = 0;
   }
 
-  RCSwitch::timings[changeCount++] = duration;
-  lastTime = time;  
+  this->timings[this->changeCount++] = duration;
 }
+
+#if defined(ESP32)
+/**
+ * Starts a task that decodes in the background, available() then only
+ * picks up the results
+ */
+bool RCSwitch::beginDecoder(UBaseType_t priority, BaseType_t core) {
+  if (this->decoder != nullptr) {
+    return true;
+  }
+  return xTaskCreatePinnedToCore(decoderTask, "rc_rx", 3072, this, priority, &this->decoder, core) == pdPASS;
+}
+
+void RCSwitch::decoderTask(void* arg) {
+  RCSwitch* self = static_cast<RCSwitch*>(arg);
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // From the ISR
+    self->decode();
+  }
+}
+#endif
 #endif
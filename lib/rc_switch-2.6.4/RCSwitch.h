@@ -60,6 +60,25 @@
 // We can handle up to (unsigned long) => 32 bit * 2 H/L changes per bit + 2 for sync
 #define RCSWITCH_MAX_CHANGES 67
 
+#if not defined( RCSwitchDisableReceiving )
+// On ESP32 (and host builds) the ISR only queues edge durations, decode()
+// turns them into codes from a task or loop(). Elsewhere (AVR has no
+// <atomic>) the ISR decodes in place, as in rc-switch
+#if defined(ESP32) || !defined(ARDUINO)
+#define RCSWITCH_QUEUED_DECODE
+#include <ef_queue.hpp>
+
+#define RCSWITCH_EDGE_RING 512
+#define RCSWITCH_RESULT_QUEUE 4
+#endif
+
+// attachInterruptArg() gives each receiver its own ISR argument; without
+// it only one RCSwitch can receive
+#if defined(ESP32) || (!defined(ARDUINO) && !defined(RaspberryPi))
+#define RCSWITCH_ISR_ARG
+#endif
+#endif
+
 class RCSwitch {
 
   public:
@@ -84,6 +103,9 @@ class RCSwitch {
     void enableReceive(int interrupt);
     void enableReceive();
     void disableReceive();
+    // Detach and re-attach the ISR only, keeping the decoded code
+    void pauseReceive();
+    void resumeReceive();
     bool available();
     void resetAvailable();
 
@@ -91,7 +113,17 @@ class RCSwitch {
     unsigned int getReceivedBitlength();
     unsigned int getReceivedDelay();
     unsigned int getReceivedProtocol();
+    // Timings of the received code, only kept after setReceiveRawdata(true)
+    // (nullptr otherwise) and valid until the next available()
     unsigned int* getReceivedRawdata();
+    void setReceiveRawdata(bool keep);
+
+    void decode(); // Decodes the queued edges, from the decoder task or loop()
+    #if defined(ESP32)
+    bool beginDecoder(UBaseType_t priority = 1, BaseType_t core = tskNO_AFFINITY);
+    #endif
+    uint32_t getLostEdges();
+    uint32_t getLostCodes();
     #endif
   
     void enableTransmit(int nTransmitterPin);
@@ -147,6 +179,7 @@ class RCSwitch {
     void setProtocol(Protocol protocol);
     void setProtocol(int nProtocol);
     void setProtocol(int nProtocol, int nPulseLength);
+    static bool getProtocol(int nProtocol, Protocol& protocol);
 
   private:
     char* getCodeWordA(const char* sGroup, const char* sDevice, bool bStatus);
@@ -156,8 +189,26 @@ class RCSwitch {
     void transmit(HighLow pulses);
 
     #if not defined( RCSwitchDisableReceiving )
-    static void handleInterrupt();
-    static bool receiveProtocol(const int p, unsigned int changeCount);
+    struct Received {
+      unsigned long value;
+      unsigned int bitlength;
+      unsigned int delay;
+      unsigned int protocol;
+      #if defined(RCSWITCH_QUEUED_DECODE)
+      uint8_t raw; // rawdata slot, if kept
+      #endif
+    };
+
+    static void handleInterrupt(void* arg);
+    #if !defined(RCSWITCH_ISR_ARG)
+    static void handleSingleInterrupt();
+    static RCSwitch* isrReceiver;
+    #endif
+    void decodeEdge(unsigned int duration);
+    bool receiveProtocol(const int p, unsigned int changeCount);
+    #if defined(ESP32)
+    static void decoderTask(void* arg);
+    #endif
     int nReceiverInterrupt;
     #endif
     int nTransmitterPin;
@@ -166,16 +217,29 @@ class RCSwitch {
     Protocol protocol;
 
     #if not defined( RCSwitchDisableReceiving )
-    static int nReceiveTolerance;
-    volatile static unsigned long nReceivedValue;
-    volatile static unsigned int nReceivedBitlength;
-    volatile static unsigned int nReceivedDelay;
-    volatile static unsigned int nReceivedProtocol;
+    // Receive state is per instance, every receiver has its own ISR argument
+    int nReceiveTolerance;
     const static unsigned int nSeparationLimit;
     /* 
      * timings[0] contains sync timing, followed by a number of bits
      */
-    static unsigned int timings[RCSWITCH_MAX_CHANGES];
+    unsigned int timings[RCSWITCH_MAX_CHANGES];
+    unsigned int changeCount;
+    unsigned int repeatCount;
+    unsigned long lastTime;   // ISR only
+    #if defined(RCSWITCH_QUEUED_DECODE)
+    eflib::SpscRing<unsigned int, RCSWITCH_EDGE_RING> edges;
+    eflib::SpscRing<Received, RCSWITCH_RESULT_QUEUE> results;
+    // Raw timings by slot, used round robin: the queued results, the one
+    // being read and the one being decoded never share a slot
+    unsigned int rawdata[RCSWITCH_RESULT_QUEUE + 2][RCSWITCH_MAX_CHANGES];
+    uint8_t rawSlot;
+    #endif
+    bool keepRawdata;
+    Received received; // Code returned by the getReceived*() methods
+    #if defined(ESP32)
+    TaskHandle_t decoder;
+    #endif
     #endif
 
     
@@ -9,7 +9,7 @@
 
 #include <RCSwitch.h>
 
-RCSwitch mySwitch = RCSwitch();
+RCSwitch mySwitch;
 
 void setup() {
   Serial.begin(9600);
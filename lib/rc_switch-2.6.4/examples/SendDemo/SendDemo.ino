@@ -7,7 +7,7 @@
 
 #include <RCSwitch.h>
 
-RCSwitch mySwitch = RCSwitch();
+RCSwitch mySwitch;
 
 void setup() {
 
@@ -8,7 +8,7 @@
 
 #include <RCSwitch.h>
 
-RCSwitch mySwitch = RCSwitch();
+RCSwitch mySwitch;
 
 void setup() {
 
@@ -14,7 +14,7 @@ uint8_t ip[] = { 192,168,0, 2 };                        // IP Address
 EthernetServer server(80);                           // Server Port 80
 
 // RCSwitch configuration
-RCSwitch mySwitch = RCSwitch();
+RCSwitch mySwitch;
 int RCTransmissionPin = 7;
 
 // More to do...
@@ -1,10 +1,14 @@
 #include <Arduino.h>
 #include <Wire.h>
 #include <PCF8574_KC868.hpp>
+#include <kc868_boards.hpp>
 #include <SPI.h>
 #include <ETH.h>
 #include <EEPROM.h>
 #include <polyfill.hpp>
+#include <ef_queue.hpp>
+#include <ef_pool.hpp>
+#include <atomic>
 
 #define serialProg Serial
 #define sLog Serial
@@ -14,17 +18,21 @@
 
 #pragma region PIN DEFINITIONS
 
-#define SDA_I2C GPIO_NUM_4
-#define SCL_I2C GPIO_NUM_5
-#define TX_RS485 GPIO_NUM_13
-#define RX_RS485 GPIO_NUM_16
-#define TX_433M GPIO_NUM_15
-#define RX_433M GPIO_NUM_2
-// HT1, HT2 and HT3
-constexpr uint8_t pinTemperature[] = { GPIO_NUM_32, GPIO_NUM_33, GPIO_NUM_14 };
-// INA1, INA2, INA3 and INA4
-// pinAnalog[0] and pinAnalog[1] (0..20mA) - pinAnalog[2] and pinAnalog[3] (0..3,3V)
-constexpr uint8_t pinAnalog[] = { GPIO_NUM_36, GPIO_NUM_34, GPIO_NUM_35, GPIO_NUM_39 };
+#if !defined(KC868_BOARD)
+  #define KC868_BOARD A16
+#endif
+using Board = kc868::KC868_BOARD;
+
+#define TX_RS485 Board::txRS485
+#define RX_RS485 Board::rxRS485
+#define TX_433M Board::tx433M
+#define RX_433M Board::rx433M
+// PCF8574 INT line, if wired to a free GPIO enables interrupt driven input refresh
+//#define INT_I2C GPIO_NUM_14
+// Second RC receiver (eg. a 315MHz module) on an HT pin not used for temperature
+//#define RX_315M GPIO_NUM_14
+constexpr const kc868::Bytes<Board::temperatures>& pinTemperature = Board::temperaturePins();
+constexpr const kc868::Bytes<Board::analogs>& pinAnalog = Board::analogPins();
 
 #pragma endregion PIN DEFINITIONS
 
@@ -32,6 +40,14 @@ constexpr uint8_t pinAnalog[] = { GPIO_NUM_36, GPIO_NUM_34, GPIO_NUM_35, GPIO_NU
 
 #define EE_MAGIC 0xEF01
 
+constexpr uint8_t MB_VIRTUAL_UNITS = 4; // Output bank, input bank, analogs, RC433 bridge
+constexpr uint8_t MB_MAX_UNIT_ID = 247; // Higher ids are reserved, 0 is broadcast
+
+// A virtual units base is usable if all its units get a valid slave id
+constexpr bool mbUnitsBaseValid(long base) {
+  return (base >= 1) && (base + MB_VIRTUAL_UNITS - 1 <= MB_MAX_UNIT_ID);
+}
+
 struct __attribute__((packed)) s_settings {
   size_t length = sizeof(*this);
   uint16_t magic = EE_MAGIC;
@@ -41,12 +57,20 @@ struct __attribute__((packed)) s_settings {
   uint8_t dns1[4] = { 0 , 0, 0, 0 };
   uint8_t dns2[4] = { 0 , 0, 0, 0 };
   uint16_t mb_id = 1;
+  uint8_t mb_units_id = 0;     // First of the MB_VIRTUAL_UNITS consecutive virtual unit ids (0 = off)
   uint16_t mb_port = 502;
+  uint32_t mb_baud = 115200;   // RTU baud rate
+  char mb_parity = 'N';        // RTU parity: N, E or O (8 data bits, 1 stop bit)
+  uint8_t mb_rx_timeout = 0;   // RTU end of frame gap in characters, 0 = standard t3.5
+  uint8_t gw_first_id = 0;     // TCP unit ids forwarded to RS485 (0 = no gateway, RTU server instead)
+  uint8_t gw_last_id = 0;
+  uint16_t gw_ttl = 500;       // Default lifetime of cached downstream reads, ms (0 = no cache)
 };
 
 millis_t lastInputPrint = 0;
 millis_t lastEthSend = 0;
-PCF8574_KC868<2, 2> pcf8574s({ 0x22, 0x21 }, { 0x24, 0x25 }, 50);
+TwoWire* const i2cWires[] = { &Wire, &Wire1 }; // The ESP32's two controllers, the first Board::buses are used
+kc868::Expanders<Board> pcf8574s(Board::addrIn(), Board::busIn(), Board::addrOut(), Board::busOut(), i2cWires, 50);
 s_settings settings;
 
 void loadSettings(const int address, s_settings &p);
@@ -55,17 +79,89 @@ void eeInit(int _size);
 void printSettings(Print& device, s_settings& s, bool showPass = false);
 void readSettings(Stream& device);
 void execCommand(Stream& device);
+void printDiagnostics(Print& device);
+void printModbusDiagnostics(Print& device);
+void printModbusStats(Print& device);
 void reboot();
+uint32_t mbSerialConfig(char parity);
+uint32_t mbFrameGap(const s_settings& s);
 void strtoip(uint8_t* addr, String s);
 void WiFiEvent(WiFiEvent_t event);
 void setupAnalog();
 void updateAnalog(millis_t now);
+void updateInputEvents();
+void updateTimedOutputs(millis_t now);
+void loadRcActions();
+bool rcExecute(uint32_t code, uint8_t bits, uint8_t protocol);
+void execRcLearn(Stream& device);
+void updateRcLearn(Stream& device, millis_t now);
+void ioHealth(pcf8574_kc868::DeviceHealth* in, pcf8574_kc868::DeviceHealth* out);
 
 #pragma endregion GLOBAL DECLARATIONS
 
+#pragma region EVENT HISTORY
+
+// Input edges, coil changes and RC433 receptions with a sequence number, so
+// Modbus masters can read what changed since their last read (FC 0x18)
+// instead of polling the whole image. Readers do not consume events.
+
+enum e_event : uint8_t {
+  EV_INPUT = 1, // index = input, value = level
+  EV_COIL = 2,  // index = coil, value = state
+  EV_RC433 = 3  // index = code bits 16..27, value = code bits 0..15
+};
+
+struct s_event {
+  uint16_t seq;
+  uint16_t what;  // type << 12 | index
+  uint16_t value;
+};
+
+s_event eventHistory[64];
+uint32_t eventNext = 0; // Sequence number of the next event
+portMUX_TYPE eventMux = portMUX_INITIALIZER_UNLOCKED;
+
+void recordEvent(e_event type, uint16_t index, uint16_t value) {
+  portENTER_CRITICAL(&eventMux);
+  s_event& ev = eventHistory[eventNext % eflib::size(eventHistory)];
+  ev.seq = (uint16_t)eventNext;
+  ev.what = ((uint16_t)type << 12) | (index & 0x0FFF);
+  ev.value = value;
+  eventNext += 1;
+  portEXIT_CRITICAL(&eventMux);
+}
+
+constexpr uint8_t eventMask(e_event type) {
+  return 1 << type;
+}
+constexpr uint8_t EVM_ALL = 0xFF;
+
+// Copies up to max events of the types in mask starting at sequence number
+// from, or at the oldest one kept if from was overwritten (the master sees
+// the gap). Sequence numbers are shared by all types, so a filtered reader
+// also sees gaps where other types were recorded
+size_t readEvents(uint16_t from, s_event* out, size_t max, uint8_t mask = EVM_ALL) {
+  portENTER_CRITICAL(&eventMux);
+  const uint32_t kept = min<uint32_t>(eventNext, eflib::size(eventHistory));
+  const uint16_t behind = (uint16_t)eventNext - from;
+  uint32_t seq = eventNext - min<uint32_t>(behind, kept);
+  size_t n = 0;
+  for (; (n < max) && (seq != eventNext); ++seq) {
+    const s_event& ev = eventHistory[seq % eflib::size(eventHistory)];
+    if (mask & (1 << (ev.what >> 12))) {
+      out[n++] = ev;
+    }
+  }
+  portEXIT_CRITICAL(&eventMux);
+  return n;
+}
+
+#pragma endregion EVENT HISTORY
+
 #pragma region RC433MHz
 
 #include <RCSwitch.h>
+#include <RCTransmitter.hpp>
 #include <output.h>
 
 struct s_packet {
@@ -122,42 +218,90 @@ const s_code a_send[] PROGMEM = {
   {4542712UL, 24, 470, 1, 5}    // Campanello esterno
 };
 
-RCSwitch ioSwitch = RCSwitch();
-s_packet last_packet = { .value = 0, .protocol = (uint16_t)-1 };
-millis_t last_packet_time = 0UL;
+// Each RCSwitch has its own ISR argument, decoder task and result queue
+struct s_receiver {
+  RCSwitch rc;
+  s_packet last = { .value = 0, .protocol = (unsigned int)-1 };
+  millis_t lastTime = 0UL;
+};
+
+s_receiver rx433;
+#if defined(RX_315M)
+s_receiver rx315;
+#endif
+RCSwitch& ioSwitch = rx433.rc;
+RCTransmitter rcTx(TX_433M);
+
+// Learn mode waiting for a code, rx433 is read by updateRcLearn() meanwhile
+struct s_rc_learn {
+  bool active = false;
+  millis_t start = 0UL;
+} rcLearn;
+
+// Runs in the transmitter task, our own signal must not be decoded. Only
+// the ISR is detached, the received code belongs to loop()
+void rcOnAir(bool onAir, void*) {
+  if (onAir) {
+    ioSwitch.pauseReceive();
+  } else {
+    ioSwitch.resumeReceive();
+  }
+}
 
 void setupRC433() {
   pinMode(RX_433M, INPUT);
-  pinMode(TX_433M, OUTPUT);
   ioSwitch.enableReceive(digitalPinToInterrupt(RX_433M));
-  ioSwitch.enableTransmit(TX_433M);
+  ioSwitch.beginDecoder();
+  #if defined(RX_315M)
+  pinMode(RX_315M, INPUT);
+  rx315.rc.enableReceive(digitalPinToInterrupt(RX_315M));
+  rx315.rc.beginDecoder();
+  #endif
+  rcTx.onAir(rcOnAir);
+  rcTx.begin();
 }
 
+// Only queues the code, the RMT transmitter task puts it on air
 void sendRC433(Print& device, size_t idx) {
   if(idx < eflib::size(a_send)) {
     s_code send;
     memcpy_P(&send, (PGM_P)&a_send[idx], sizeof(send));
-    RCPrintAndSend(device, ioSwitch, send.code, send.b_size, send.p_len, send.protocol, send.repeat);
+    PrintData(device, send.code, send.b_size, send.p_len, send.protocol, send.repeat);
+    const RCTransmission t = { send.code, send.b_size, (uint16_t)send.p_len, send.protocol, send.repeat };
+    device.println(rcTx.submit(t) ? F("Data transmission queued") : F("Transmit queue full, data dropped"));
   }
 }
 
-void updateRC433(Print& device, millis_t now) {
-  if (last_packet.isValid() && (now - last_packet_time >= packet_delay_ms)) {
+void updateReceiver(Print& device, s_receiver& rx, millis_t now) {
+  if (rx.last.isValid() && (now - rx.lastTime >= packet_delay_ms)) {
     device.println(F("Button released"));
-    last_packet.invalidate();
+    rx.last.invalidate();
   }
-  if (ioSwitch.available()) {
+  if (rx.rc.available()) {
     millis_t now = millis();
-    s_packet currentPacket = { .value = ioSwitch.getReceivedValue(), .protocol = ioSwitch.getReceivedProtocol() };
-    if (currentPacket.isValid() && (currentPacket != last_packet)) {
+    s_packet currentPacket = { .value = rx.rc.getReceivedValue(), .protocol = rx.rc.getReceivedProtocol() };
+    if (currentPacket.isValid() && (currentPacket != rx.last)) {
       device.println(F("Button pressed"));
-      printRC(device, false, currentPacket.value, ioSwitch.getReceivedBitlength(),
-              ioSwitch.getReceivedDelay(), currentPacket.protocol, ioSwitch.getReceivedRawdata());
+      printRC(device, false, currentPacket.value, rx.rc.getReceivedBitlength(),
+              rx.rc.getReceivedDelay(), currentPacket.protocol, rx.rc.getReceivedRawdata());
+      recordEvent(EV_RC433, (uint16_t)(currentPacket.value >> 16), (uint16_t)currentPacket.value);
+      if (rcExecute(currentPacket.value, rx.rc.getReceivedBitlength(), currentPacket.protocol)) {
+        device.println(F("Action executed"));
+      }
     }
-    last_packet = currentPacket;
-    last_packet_time = now;
-    ioSwitch.resetAvailable();
+    rx.last = currentPacket;
+    rx.lastTime = now;
+    rx.rc.resetAvailable();
+  }
+}
+
+void updateRC433(Print& device, millis_t now) {
+  if (!rcLearn.active) {
+    updateReceiver(device, rx433, now);
   }
+  #if defined(RX_315M)
+  updateReceiver(device, rx315, now);
+  #endif
 }
 
 #pragma endregion RC433MHz
@@ -220,8 +364,22 @@ void printSettings(Print& device, s_settings& s, bool showPass) {
   device.print(F("Modbus Id: "));
   device.println(s.mb_id);
 
+  if (mbUnitsBaseValid(s.mb_units_id)) {
+    device.printf("Modbus virtual units: %u..%u\n", s.mb_units_id, s.mb_units_id + MB_VIRTUAL_UNITS - 1);
+  } else {
+    device.println(F("Modbus virtual units: off"));
+  }
+
   device.print(F("Modbus Port: "));
   device.println(s.mb_port);
+
+  device.printf("Modbus RTU: %lu 8%c1, frame gap %lu us\n", (unsigned long)s.mb_baud, s.mb_parity, (unsigned long)mbFrameGap(s));
+
+  if ((s.gw_first_id != 0) && (s.gw_first_id <= s.gw_last_id)) {
+    device.printf("Gateway: units %u..%u to RS485, cache %u ms\n", s.gw_first_id, s.gw_last_id, s.gw_ttl);
+  } else {
+    device.println(F("Gateway: off"));
+  }
 }
 
 void readSettings(Stream& device) {
@@ -248,9 +406,40 @@ void readSettings(Stream& device) {
   device.print(F("Modbus Id Number: "));
   news.mb_id = readRow(device, e_char_type::normal, true).toInt();
 
+  device.print(F("Modbus Virtual Units First Id [0 = off]: "));
+  const long unitsId = readRow(device, e_char_type::normal, true).toInt();
+  if ((unitsId != 0) && !mbUnitsBaseValid(unitsId)) {
+    device.printf("Virtual units need ids 1..%u, turned off\n", MB_MAX_UNIT_ID);
+  }
+  news.mb_units_id = mbUnitsBaseValid(unitsId) ? unitsId : 0;
+
   device.print(F("Modbus Port: "));
   news.mb_port = readRow(device, e_char_type::normal, true).toInt();
 
+  device.print(F("Modbus RTU Baud: "));
+  news.mb_baud = readRow(device, e_char_type::normal, true).toInt();
+  if (news.mb_baud == 0) {
+    news.mb_baud = s_settings().mb_baud;
+  }
+
+  device.print(F("Modbus RTU Parity [N/E/O]: "));
+  const String parity = readRow(device, e_char_type::upper, true);
+  news.mb_parity = ((parity == "E") || (parity == "O")) ? parity[0] : 'N';
+
+  device.print(F("Modbus RTU Frame Gap [chars, 0 = standard]: "));
+  const long rxTimeout = readRow(device, e_char_type::normal, true).toInt();
+  news.mb_rx_timeout = constrain(rxTimeout, 0, 100);
+
+  device.print(F("Gateway First Unit Id [0 = off]: "));
+  news.gw_first_id = readRow(device, e_char_type::normal, true).toInt();
+  if (news.gw_first_id != 0) {
+    device.print(F("Gateway Last Unit Id: "));
+    news.gw_last_id = readRow(device, e_char_type::normal, true).toInt();
+
+    device.print(F("Gateway Cache TTL [ms]: "));
+    news.gw_ttl = readRow(device, e_char_type::normal, true).toInt();
+  }
+
   device.println();
   printSettings(device, news, true);
   device.print(F("Save? [N/y]: "));
@@ -268,11 +457,48 @@ void execRC433(Stream& device) {
   sendRC433(device, s.toInt());
 }
 
+void printHealth(Print& device, const char* kind, uint8_t block, uint8_t addr, const pcf8574_kc868::DeviceHealth& h) {
+  device.printf("%s%u 0x%02X %s ok=%lu err=%lu consecutive=%u backoff=%u\n", kind, block, addr,
+                h.online ? "online " : "OFFLINE", (unsigned long)h.ok, (unsigned long)h.errors, h.consecutive, h.backoff);
+}
+
+void printDiagnostics(Print& device) {
+  device.println(F("[Diagnostics]"));
+  pcf8574_kc868::DeviceHealth healthIn[eflib::size(pcf8574s.healthIn)];
+  pcf8574_kc868::DeviceHealth healthOut[eflib::size(pcf8574s.healthOut)];
+  ioHealth(healthIn, healthOut); // Owned by the I/O task
+  for (uint8_t block = 0; block < eflib::size(healthIn); ++block)
+    printHealth(device, "IN", block, pcf8574s.addrIn(block), healthIn[block]);
+  for (uint8_t block = 0; block < eflib::size(healthOut); ++block)
+    printHealth(device, "OUT", block, pcf8574s.addrOut(block), healthOut[block]);
+  device.printf("Input events lost: %lu\n", (unsigned long)pcf8574s.events.overflows);
+  device.printf("RC433 sent: %lu, failed: %lu, dropped: %lu, queued: %u\n", (unsigned long)rcTx.sent,
+                (unsigned long)rcTx.failed, (unsigned long)rcTx.dropped, (unsigned)rcTx.pending());
+  device.printf("RC433 edges lost: %lu, codes lost: %lu\n", (unsigned long)ioSwitch.getLostEdges(),
+                (unsigned long)ioSwitch.getLostCodes());
+  #if defined(RX_315M)
+  device.printf("RC315 edges lost: %lu, codes lost: %lu\n", (unsigned long)rx315.rc.getLostEdges(),
+                (unsigned long)rx315.rc.getLostCodes());
+  #endif
+  device.printf("Free heap: %lu, largest block: %lu, lowest: %lu\n", (unsigned long)ESP.getFreeHeap(),
+                (unsigned long)ESP.getMaxAllocHeap(), (unsigned long)ESP.getMinFreeHeap());
+  printModbusDiagnostics(device);
+}
+
 void execCommand(Stream& device) {
   char query = readChar(device, e_char_type::upper);
   switch(query) {
     case '\0':
       break;
+    case 'D':
+      printDiagnostics(device);
+      break;
+    case 'M':
+      printModbusStats(device);
+      break;
+    case 'L':
+      execRcLearn(device);
+      break;
     case 'N':
       execRC433(device);
       break;
@@ -403,251 +629,1764 @@ void updateAnalog(millis_t now) {
 
 #pragma endregion ANALOGS
 
+#pragma region INPUT EVENTS
+
+// Single consumer of pcf8574s.events
+void updateInputEvents() {
+  pcf8574_kc868::InputEvent ev;
+  while (pcf8574s.events.pop(ev)) {
+    recordEvent(EV_INPUT, ev.input, ev.level);
+  }
+}
+
+#pragma endregion INPUT EVENTS
+
+#pragma region TIMED OUTPUTS
+
+// Holding registers 0..31 are free for the masters, HR_TIMER.. drive the timed outputs
+constexpr uint16_t HR_TIMER = 32;
+uint16_t hold_registers[HR_TIMER + 16];
+// Coil image as holding registers, 16 coils per register (coil 0 in bit 0),
+// so masters can mask-write or read-modify-write outputs in one request
+constexpr uint16_t HR_COILS = 64;
+constexpr uint16_t HR_COIL_WORDS = (Board::outputBlocks + 1) / 2;
+
+#include <TimedOutput.hpp>
+
+// Timer control block, writing TMR_CMD runs the command in the I/O task,
+// which then sets TMR_CMD to TMR_DONE or TMR_ERROR
+enum e_timer_reg : uint16_t {
+  TMR_CMD,      // Command
+  TMR_OUTPUT,   // Output index
+  TMR_TIME_LO,  // Time in ms, low word
+  TMR_TIME_HI,  // Time in ms, high word
+  TMR_STEPS,    // Number of sequence steps
+  TMR_STEP0,    // Steps: (value << 15 | output), delay in ms from the previous step
+  TMR_MAX_STEPS = (eflib::size(hold_registers) - HR_TIMER - TMR_STEP0) / 2
+};
+enum e_timer_cmd : uint16_t {
+  TMR_DONE = 0,
+  TMR_PULSE = 1,
+  TMR_ON_DELAY = 2,
+  TMR_OFF_DELAY = 3,
+  TMR_SEQUENCE = 4,
+  TMR_CANCEL = 5,
+  TMR_ERROR = 0xFFFF
+};
+
+TimedOutput<kc868::Expanders<Board>, 64, 256, Board::outputBlocks * 8> timedOutputs(pcf8574s);
+
+bool execTimerCommand(const uint16_t* regs) {
+  const uint16_t output = regs[TMR_OUTPUT];
+  const uint32_t ms = ((uint32_t)regs[TMR_TIME_HI] << 16) | regs[TMR_TIME_LO];
+  if ((regs[TMR_CMD] != TMR_SEQUENCE) && (output >= pcf8574s.outputs())) {
+    return false;
+  }
+  switch (regs[TMR_CMD]) {
+    case TMR_PULSE:
+      return timedOutputs.pulse(output, ms);
+    case TMR_ON_DELAY:
+      return timedOutputs.onDelay(output, ms);
+    case TMR_OFF_DELAY:
+      return timedOutputs.offDelay(output, ms);
+    case TMR_CANCEL:
+      timedOutputs.cancel(output);
+      return true;
+    case TMR_SEQUENCE: {
+      const uint16_t count = regs[TMR_STEPS];
+      if (count > TMR_MAX_STEPS) {
+        return false;
+      }
+      timed_output::Step steps[TMR_MAX_STEPS];
+      for (uint16_t i = 0; i < count; ++i) {
+        const uint16_t target = regs[TMR_STEP0 + i * 2];
+        steps[i] = { (uint16_t)(target & 0x7FFF), (target & 0x8000) != 0, regs[TMR_STEP0 + i * 2 + 1] };
+        if (steps[i].output >= pcf8574s.outputs()) {
+          return false;
+        }
+      }
+      return timedOutputs.sequence(steps, count);
+    }
+    default:
+      return false;
+  }
+}
+
+void updateTimedOutputs(millis_t now) {
+  timedOutputs.update(now);
+}
+
+#pragma endregion TIMED OUTPUTS
+
+#pragma region IO OWNER
+
+// A single task owns pcf8574s, analog[], hold_registers and the timed
+// outputs. Other tasks post writes to a lock-free queue and read a
+// consistent copy of the process image published through a seqlock.
+// The I2C engine tasks only post their completions, which pcf8574s applies
+// in updateInput()/updateOutput() here.
+
+// Data versions, bumped by the I/O task when it publishes a change
+enum e_version : uint8_t {
+  VER_NONE,   // Not versioned (volatile, never cached)
+  VER_HOLD,   // hold_registers and the coil words
+  VER_ANALOG, // analog[]
+  VER_COUNT
+};
+
+struct s_image {
+  uint32_t version[VER_COUNT];
+  uint8_t ins[Board::inputBlocks];
+  uint8_t outs[Board::outputBlocks];
+  pcf8574_kc868::DeviceHealth healthIn[Board::inputBlocks];
+  pcf8574_kc868::DeviceHealth healthOut[Board::outputBlocks];
+  uint16_t analog[eflib::size(::analog)];
+  uint16_t hold[eflib::size(hold_registers)];
+};
+
+enum class e_io_cmd : uint8_t {
+  WRITE_COILS,          // Packed bits from start
+  WRITE_REGISTERS,      // Registers from start
+  MASK_REGISTER,        // start = (start & regs[0]) | (regs[1] & ~regs[0])
+  READ_WRITE_REGISTERS, // Writes regs from start, then reads readCount from readStart into the reply slot
+  TOGGLE_COIL,          // Inverts output start
+  TIMER                 // regs laid out as the timer block, run without touching HR_TIMER
+};
+
+struct s_io_cmd {
+  e_io_cmd cmd;
+  uint16_t start;
+  uint16_t count;
+  union {
+    uint8_t coils[Board::outputBlocks];
+    uint16_t regs[eflib::size(hold_registers)];
+  };
+  uint16_t readStart;
+  uint16_t readCount;
+};
+
+// Registers read by a command, tagged with its ticket: a caller that gave
+// up waiting leaves the I/O task nothing of its own to write into
+struct s_io_reply {
+  uint32_t ticket;
+  uint16_t regs[eflib::size(hold_registers)];
+};
+
+constexpr millis_t ioWaitTimeout = 100;
+
+eflib::MpscQueue<s_io_cmd, 16> ioQueue;
+eflib::SeqLock<s_image> ioImage;
+eflib::SeqLock<s_io_reply> ioReplies[8]; // By ticket, a reused slot reads as a timeout
+std::atomic<uint32_t> ioApplied { 0 }; // Commands applied and published
+TaskHandle_t ioTaskHandle = nullptr;
+
+// Register space of the I/O task: hold_registers and the coil words
+constexpr bool ioRegisterSpan(uint32_t start, uint32_t count) {
+  return (start + count <= eflib::size(hold_registers)) ||
+         ((start >= HR_COILS) && (start + count <= HR_COILS + HR_COIL_WORDS));
+}
+
+// Register addr over the given hold_registers and coil images
+uint16_t ioRegister(const uint16_t* hold, const uint8_t* outs, uint16_t addr) {
+  if (addr < eflib::size(hold_registers)) {
+    return hold[addr];
+  }
+  if ((addr >= HR_COILS) && (addr < HR_COILS + HR_COIL_WORDS)) {
+    const size_t block = (addr - HR_COILS) * 2;
+    return outs[block] | ((block + 1 < Board::outputBlocks) ? (uint16_t)outs[block + 1] << 8 : 0);
+  }
+  return 0;
+}
+
+uint16_t ioReadRegister(uint16_t addr) {
+  return ioRegister(hold_registers, pcf8574s.outs, addr);
+}
+
+void ioWriteRegisters(uint16_t start, uint16_t count, const uint16_t* regs) {
+  for (uint16_t i = 0; i < count; ++i) {
+    const uint16_t addr = start + i;
+    if (addr < eflib::size(hold_registers)) {
+      hold_registers[addr] = regs[i];
+    } else if ((addr >= HR_COILS) && (addr < HR_COILS + HR_COIL_WORDS)) {
+      const size_t first = (addr - HR_COILS) * 16;
+      const uint8_t bits[2] = { (uint8_t)(regs[i] & 0xFF), (uint8_t)(regs[i] >> 8) };
+      pcf8574s.writeOutputs(first, min<size_t>(16, pcf8574s.outputs() - first), bits);
+      pcf8574s.scheduleFlushOutput();
+    }
+  }
+  if ((start <= HR_TIMER + TMR_CMD) && (start + count > HR_TIMER + TMR_CMD)) {
+    uint16_t* regs = &hold_registers[HR_TIMER];
+    regs[TMR_CMD] = execTimerCommand(regs) ? TMR_DONE : TMR_ERROR;
+  }
+}
+
+void ioApply(const s_io_cmd& c, uint32_t ticket) {
+  switch (c.cmd) {
+    case e_io_cmd::WRITE_COILS:
+      pcf8574s.writeOutputs(c.start, c.count, c.coils);
+      pcf8574s.scheduleFlushOutput();
+      break;
+    case e_io_cmd::WRITE_REGISTERS:
+      ioWriteRegisters(c.start, c.count, c.regs);
+      break;
+    case e_io_cmd::MASK_REGISTER: {
+      const uint16_t value = (ioReadRegister(c.start) & c.regs[0]) | (c.regs[1] & ~c.regs[0]);
+      ioWriteRegisters(c.start, 1, &value);
+      break;
+    }
+    case e_io_cmd::READ_WRITE_REGISTERS: {
+      ioWriteRegisters(c.start, c.count, c.regs);
+      s_io_reply r;
+      r.ticket = ticket;
+      for (uint16_t i = 0; i < c.readCount; ++i)
+        r.regs[i] = ioReadRegister(c.readStart + i);
+      ioReplies[ticket % eflib::size(ioReplies)].write(r);
+      break;
+    }
+    case e_io_cmd::TOGGLE_COIL:
+      if (c.start < pcf8574s.outputs()) {
+        const uint8_t bit = ((pcf8574s.outs[c.start / 8] >> (c.start % 8)) & 1) ^ 1;
+        pcf8574s.writeOutputs(c.start, 1, &bit);
+        pcf8574s.scheduleFlushOutput();
+      }
+      break;
+    case e_io_cmd::TIMER:
+      execTimerCommand(c.regs);
+      break;
+  }
+}
+
+void ioPublish() {
+  static s_image img; // Last published, keeps the versions
+  if ((memcmp(img.hold, hold_registers, sizeof(img.hold)) != 0) || (memcmp(img.outs, pcf8574s.outs, sizeof(img.outs)) != 0)) {
+    img.version[VER_HOLD] += 1;
+  }
+  if (memcmp(img.analog, analog, sizeof(img.analog)) != 0) {
+    img.version[VER_ANALOG] += 1;
+  }
+  for (uint8_t block = 0; block < Board::outputBlocks; ++block) {
+    const uint8_t changed = img.outs[block] ^ pcf8574s.outs[block];
+    for (uint8_t bit = 0; changed >> bit; ++bit) {
+      if (changed & (1 << bit)) {
+        recordEvent(EV_COIL, block * 8 + bit, (pcf8574s.outs[block] >> bit) & 1);
+      }
+    }
+  }
+  memcpy(img.ins, pcf8574s.ins, sizeof(img.ins));
+  memcpy(img.outs, pcf8574s.outs, sizeof(img.outs));
+  memcpy(img.healthIn, pcf8574s.healthIn, sizeof(img.healthIn));
+  memcpy(img.healthOut, pcf8574s.healthOut, sizeof(img.healthOut));
+  memcpy(img.analog, analog, sizeof(img.analog));
+  memcpy(img.hold, hold_registers, sizeof(img.hold));
+  ioImage.write(img);
+}
+
+void ioTask(void* arg) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, 1); // Woken by ioPost() or once per tick
+    const millis_t now = millis();
+    const uint32_t first = ioApplied.load(std::memory_order_relaxed); // Ticket of the next pop
+    uint32_t applied = 0;
+    s_io_cmd cmd;
+    while (ioQueue.pop(cmd)) {
+      ioApply(cmd, first + applied);
+      applied += 1;
+    }
+    pcf8574s.updateInput();
+    pcf8574s.updateOutput();
+    updateInputEvents();
+    updateTimedOutputs(now);
+    updateAnalog(now);
+    ioPublish();
+    if (applied) {
+      ioApplied.fetch_add(applied, std::memory_order_release);
+    }
+  }
+}
+
+bool setupIO() {
+  ioPublish();
+  // Above the Modbus server tasks, so a reader never spins on a half
+  // written image while holding the core the writer needs
+  return xTaskCreatePinnedToCore(ioTask, "io", 4096, nullptr, 10, &ioTaskHandle, tskNO_AFFINITY) == pdPASS;
+}
+
+// Non blocking, lock-free read of the whole process image
+void ioSnapshot(s_image& img) {
+  ioImage.read(img, [] { vTaskDelay(1); });
+}
+
+// Health of the expanders as last published by the I/O task
+void ioHealth(pcf8574_kc868::DeviceHealth* in, pcf8574_kc868::DeviceHealth* out) {
+  s_image img;
+  ioSnapshot(img);
+  memcpy(in, img.healthIn, sizeof(img.healthIn));
+  memcpy(out, img.healthOut, sizeof(img.healthOut));
+}
+
+// Queues a write and waits (bounded) until it is visible in the image;
+// false if the queue is full. With reply the registers read are copied
+// there, false as well when they did not come within ioWaitTimeout
+bool ioPost(const s_io_cmd& c, uint16_t* reply = nullptr) {
+  uint32_t ticket;
+  if (!ioQueue.push(c, &ticket)) {
+    return false;
+  }
+  xTaskNotifyGive(ioTaskHandle);
+  const millis_t start = millis();
+  bool applied;
+  while (!(applied = ((int32_t)(ioApplied.load(std::memory_order_acquire) - (ticket + 1)) >= 0)) &&
+         (millis() - start < ioWaitTimeout)) {
+    vTaskDelay(1);
+  }
+  if (reply == nullptr) {
+    return true; // Applied later if not yet
+  }
+  if (!applied) {
+    return false;
+  }
+  s_io_reply r;
+  ioReplies[ticket % eflib::size(ioReplies)].read(r, [] { vTaskDelay(1); });
+  if (r.ticket != ticket) {
+    return false;
+  }
+  memcpy(reply, r.regs, c.readCount * sizeof(uint16_t));
+  return true;
+}
+
+bool blocksOnline(const pcf8574_kc868::DeviceHealth* health, size_t start, size_t count) {
+  for (size_t block = start / 8; block * 8 < start + count; ++block) {
+    if (!health[block].online) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#pragma endregion IO OWNER
+
+#pragma region RC ACTIONS
+
+// Received codes mapped to local actions, so a remote drives the outputs
+// without a round trip through the Modbus master. Open addressing hash
+// table kept in RAM, stored in the eeprom right after the settings
+enum e_rc_action : uint8_t {
+  RCA_NONE,     // Free slot
+  RCA_TOGGLE,   // Inverts output target
+  RCA_PULSE,    // Output target on for value ms
+  RCA_REGISTER  // Holding register target = value
+};
+
+struct __attribute__((packed)) s_rc_action {
+  uint32_t code;
+  uint8_t bits;
+  uint8_t protocol;
+  uint8_t action;   // e_rc_action
+  uint16_t target;  // Output index or holding register
+  uint16_t value;   // Pulse time in ms or register value
+};
+
+constexpr uint8_t RC_ACTION_BITS = 5;
+constexpr size_t RC_ACTIONS = 1 << RC_ACTION_BITS;
+constexpr size_t RC_ACTIONS_MAX = RC_ACTIONS * 3 / 4; // Keeps the probe sequences short
+constexpr int EE_RC_ACTIONS = sizeof(s_settings);
+
+struct __attribute__((packed)) s_rc_table {
+  size_t length = sizeof(*this);
+  uint16_t magic = EE_MAGIC;
+  s_rc_action slots[RC_ACTIONS];
+};
+
+static_assert(EE_RC_ACTIONS + sizeof(s_rc_table) < EE_SIZE, "RC actions do not fit in the eeprom");
+
+s_rc_table rcActions;
+
+size_t rcHash(uint32_t code, uint8_t bits, uint8_t protocol) {
+  const uint32_t h = (code ^ (((uint32_t)bits << 8 | protocol) * 0x9E3779B1UL)) * 0x9E3779B1UL;
+  return h >> (32 - RC_ACTION_BITS);
+}
+
+// Slot holding the key, else the free slot where it goes; nullptr if full
+s_rc_action* rcSlot(s_rc_table& table, uint32_t code, uint8_t bits, uint8_t protocol) {
+  size_t h = rcHash(code, bits, protocol);
+  for (size_t i = 0; i < RC_ACTIONS; ++i, h = (h + 1) & (RC_ACTIONS - 1)) {
+    s_rc_action& a = table.slots[h];
+    if ((a.action == RCA_NONE) || ((a.code == code) && (a.bits == bits) && (a.protocol == protocol))) {
+      return &a;
+    }
+  }
+  return nullptr;
+}
+
+size_t rcCount(const s_rc_table& table) {
+  size_t count = 0;
+  for (const s_rc_action& a : table.slots)
+    count += (a.action != RCA_NONE) ? 1 : 0;
+  return count;
+}
+
+void loadRcActions() {
+  if ((EE_RC_ACTIONS + sizeof(rcActions)) < EEPROM.length()) {
+    EEPROM.get(EE_RC_ACTIONS, rcActions);
+    if ((rcActions.magic != EE_MAGIC) || (rcActions.length != sizeof(s_rc_table))) {
+      rcActions = s_rc_table();
+      logoutln(F("No RC actions in the eeprom."));
+    }
+  } else logoutln(F("Eeprom size too small."));
+}
+
+void saveRcActions() {
+  if ((EE_RC_ACTIONS + sizeof(rcActions)) < EEPROM.length()) {
+    EEPROM.put(EE_RC_ACTIONS, rcActions);
+    EEPROM.commit();
+    logoutln(F("RC actions were stored in the eeprom."));
+  } else logoutln(F("Eeprom size too small."));
+}
+
+// Adds or replaces the entry, RCA_NONE removes it. The table is rebuilt
+// so removals leave no holes in the probe sequences
+bool rcStore(const s_rc_action& entry) {
+  s_rc_table table;
+  memset(table.slots, 0, sizeof(table.slots));
+  for (const s_rc_action& a : rcActions.slots) {
+    if ((a.action != RCA_NONE) && !((a.code == entry.code) && (a.bits == entry.bits) && (a.protocol == entry.protocol))) {
+      *rcSlot(table, a.code, a.bits, a.protocol) = a;
+    }
+  }
+  if (entry.action != RCA_NONE) {
+    if (rcCount(table) >= RC_ACTIONS_MAX) {
+      return false;
+    }
+    *rcSlot(table, entry.code, entry.bits, entry.protocol) = entry;
+  }
+  rcActions = table;
+  saveRcActions();
+  return true;
+}
+
+// Called from the loop on a new press, the I/O task applies it on its next wake
+bool rcExecute(uint32_t code, uint8_t bits, uint8_t protocol) {
+  const s_rc_action* a = rcSlot(rcActions, code, bits, protocol);
+  if ((a == nullptr) || (a->action == RCA_NONE)) {
+    return false;
+  }
+  switch (a->action) {
+    case RCA_TOGGLE:
+      return ioPost({ e_io_cmd::TOGGLE_COIL, a->target, 1 });
+    case RCA_PULSE: {
+      s_io_cmd cmd = { e_io_cmd::TIMER };
+      cmd.regs[TMR_CMD] = TMR_PULSE;
+      cmd.regs[TMR_OUTPUT] = a->target;
+      cmd.regs[TMR_TIME_LO] = a->value;
+      cmd.regs[TMR_TIME_HI] = 0;
+      return ioPost(cmd);
+    }
+    case RCA_REGISTER: {
+      s_io_cmd cmd = { e_io_cmd::WRITE_REGISTERS, a->target, 1 };
+      cmd.regs[0] = a->value;
+      return ioPost(cmd);
+    }
+    default:
+      return false;
+  }
+}
+
+void printRcActions(Print& device) {
+  device.printf("[RC Actions] %u of %u\n", (unsigned)rcCount(rcActions), (unsigned)RC_ACTIONS_MAX);
+  for (const s_rc_action& a : rcActions.slots) {
+    switch (a.action) {
+      case RCA_TOGGLE:
+        device.printf("%08lX/%u/%u: toggle output %u\n", (unsigned long)a.code, a.bits, a.protocol, a.target);
+        break;
+      case RCA_PULSE:
+        device.printf("%08lX/%u/%u: pulse output %u for %u ms\n", (unsigned long)a.code, a.bits, a.protocol, a.target, a.value);
+        break;
+      case RCA_REGISTER:
+        device.printf("%08lX/%u/%u: holding register %u = %u\n", (unsigned long)a.code, a.bits, a.protocol, a.target, a.value);
+        break;
+    }
+  }
+}
+
+// Learn mode: the next received code is bound to an action. Only starts
+// the wait, updateRcLearn() polls for the code from the loop
+void execRcLearn(Stream& device) {
+  printRcActions(device);
+  device.println(F("[Learn RC action] Press the remote button..."));
+  while (ioSwitch.available()) // Drops codes received before learn mode
+    ioSwitch.resetAvailable();
+  rcLearn.active = true;
+  rcLearn.start = millis();
+}
+
+// From the loop: gives up after 10 s, or takes the code and prompts for
+// its action as the other console commands do
+void updateRcLearn(Stream& device, millis_t now) {
+  if (!rcLearn.active) {
+    return;
+  }
+  if (!ioSwitch.available()) {
+    if (now - rcLearn.start >= 10000) {
+      rcLearn.active = false;
+      device.println(F("No code received"));
+    }
+    return;
+  }
+  rcLearn.active = false;
+  s_rc_action entry = { (uint32_t)ioSwitch.getReceivedValue(), (uint8_t)ioSwitch.getReceivedBitlength(),
+                        (uint8_t)ioSwitch.getReceivedProtocol() };
+  ioSwitch.resetAvailable();
+  device.printf("Code %08lX, %u bits, protocol %u\n", (unsigned long)entry.code, entry.bits, entry.protocol);
+
+  device.print(F("Action [T=toggle/P=pulse/H=register/D=delete]: "));
+  const String action = readRow(device, e_char_type::upper, true);
+  if (action == "T") {
+    entry.action = RCA_TOGGLE;
+  } else if (action == "P") {
+    entry.action = RCA_PULSE;
+  } else if (action == "H") {
+    entry.action = RCA_REGISTER;
+  } else if (action != "D") {
+    return;
+  }
+  if (entry.action != RCA_NONE) {
+    device.print((entry.action == RCA_REGISTER) ? F("Holding register: ") : F("Output: "));
+    const long target = readRow(device, e_char_type::normal, true).toInt();
+    // Registers as seen by the I/O task: hold_registers and the coil words
+    const bool valid = (entry.action == RCA_REGISTER)
+      ? (((target >= 0) && (target < (long)eflib::size(hold_registers))) ||
+         ((target >= HR_COILS) && (target < HR_COILS + HR_COIL_WORDS)))
+      : ((target >= 0) && (target < (long)pcf8574s.outputs()));
+    if (!valid) {
+      device.println(F("Invalid target"));
+      return;
+    }
+    entry.target = (uint16_t)target;
+    if (entry.action != RCA_TOGGLE) {
+      device.print((entry.action == RCA_PULSE) ? F("Time [ms]: ") : F("Value: "));
+      entry.value = readRow(device, e_char_type::normal, true).toInt();
+    }
+  }
+  const bool stored = rcStore(entry);
+  device.println(stored ? F("Stored") : F("Table full"));
+  if (stored) {
+    // A button still held, or repeats queued while we were prompting,
+    // must not fire the new action right away
+    while (ioSwitch.available())
+      ioSwitch.resetAvailable();
+    rx433.last = { entry.code, entry.protocol };
+    rx433.lastTime = millis();
+  }
+}
+
+#pragma endregion RC ACTIONS
+
 #pragma region MODBUS
 
-#include <ModbusServerTCPasync.h>
+#include <ModbusServerWiFi.h>
 #include <ModbusServerRTU.h>
-
-// Create server
-ModbusServerTCPasync MBTcpServer;
+#include <ModbusClientRTU.h>
+#include <ModbusGateway.hpp>
+
+// Create server. The TCP server runs one task per connection (WiFiServer
+// sits on lwIP, so it serves ETH too): a worker that waits, like the
+// gateway's, only holds up its own client
+constexpr uint8_t MB_TCP_CLIENTS = 4;
+ModbusServerWiFi MBTcpServer;
 ModbusServerRTU MBserver(2000);
 
-uint16_t hold_registers[32];
+std::atomic<uint32_t> mbResponses { 0 };
+constexpr uint16_t MB_FRAME_SIZE = 256; // Largest RTU ADU, the TCP PDU is smaller
+eflib::BufferPool<MB_TCP_CLIENTS + 2, MB_FRAME_SIZE> mbFrames; // One per concurrent handler (TCP clients, RTU) plus a spare
+
+// Pooled staging buffer the response is serialized into. eModbus workers
+// return a ModbusMessage by value and free it after sending, so message()
+// still makes one allocation per reply, at the final size, instead of the
+// vector growing while the handler adds to it
+class MbFrame {
+  public:
+    explicit MbFrame(const ModbusMessage& request)
+      : serverID(request.getServerID()), fc(request.getFunctionCode()), buff(mbFrames.acquire()) {
+      add(serverID).add(fc);
+    }
+    ~MbFrame() {
+      if (buff != nullptr) {
+        mbFrames.release(buff);
+      }
+    }
+    MbFrame(const MbFrame&) = delete;
+    MbFrame& operator=(const MbFrame&) = delete;
 
-// Server function to handle FC01=READ_COIL or FC02=READ_DISCR_INPUT
-ModbusMessage FC01(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
-  uint16_t start = 0;          // Start address
-  uint16_t count = 0;          // # of coils requested
-  request.get(2, start);       // read address from request
-  request.get(4, count);       // read # of words from request
+    MbFrame& add(uint8_t v) {
+      uint8_t* p = reserve(1);
+      if (p != nullptr) {
+        *p = v;
+      }
+      return *this;
+    }
+    MbFrame& add(uint16_t v) {
+      return add((uint8_t)(v >> 8)).add((uint8_t)(v & 0xFF));
+    }
+    // Space for n raw bytes, nullptr when no buffer could be acquired or
+    // the frame would outgrow it, which answers exception 0x04 instead
+    uint8_t* reserve(uint16_t n) {
+      if ((buff == nullptr) || overflow) {
+        return nullptr;
+      }
+      if (len + n > MB_FRAME_SIZE) {
+        error(SERVER_DEVICE_FAILURE);
+        overflow = true;
+        return nullptr;
+      }
+      uint8_t* p = &buff[len];
+      len += n;
+      return p;
+    }
+    void echo(const ModbusMessage& request) { // Request header and first 4 data bytes
+      uint8_t* p = reserve(4);
+      if (p != nullptr) {
+        memcpy(p, request.data() + 2, 4);
+      }
+    }
+    void error(Error code) {
+      if (overflow) {
+        return; // Keeps the overflow exception
+      }
+      len = 0;
+      add(serverID).add((uint8_t)(fc | 0x80)).add((uint8_t)code);
+    }
+    bool ok() const {
+      return buff != nullptr;
+    }
+    // The whole pool buffer, for a frame copied in from elsewhere (the
+    // gateway's downstream answer, id and FC included); assign() sets its length
+    uint8_t* buffer() {
+      return buff;
+    }
+    void assign(uint16_t n) {
+      len = (n <= MB_FRAME_SIZE) ? n : 0;
+      overflow = false;
+    }
+    ModbusMessage message() const {
+      ModbusMessage response(len);
+      if (buff != nullptr) {
+        response.add(buff, len);
+        mbResponses.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        response.setError(serverID, fc, SERVER_DEVICE_BUSY);
+      }
+      return response;
+    }
+  private:
+    const uint8_t serverID;
+    const uint8_t fc;
+    uint8_t* const buff;
+    uint16_t len = 0;
+    bool overflow = false;
+};
 
-  if ((start + count) > pcf8574s.outputs()) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+#pragma region MODBUS STATS
+
+// Per server and function code request/exception counters and a latency
+// histogram in log2 microsecond buckets (bucket k counts [2^(k-1), 2^k) us,
+// the last one everything slower), measured with the CPU cycle counter
+enum e_mb_server : uint8_t {
+  MBS_TCP,     // MBTcpServer, own unit id
+  MBS_RTU,     // MBserver
+  MBS_GATEWAY, // MBTcpServer, forwarded to RS485
+  MBS_COUNT
+};
+
+constexpr uint8_t mbStatFc[] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x0F, 0x10, 0x16, 0x17, 0x18, 0x41 };
+constexpr uint8_t MB_FC_SLOTS = eflib::size(mbStatFc) + 1; // Last slot: any other FC
+constexpr uint8_t MB_BUCKETS = 16;
+constexpr uint8_t MB_ERRORS = 12; // Exception codes 0x01..0x0B, slot 0 any other
+
+struct s_mb_fc_stats {
+  std::atomic<uint32_t> requests;
+  std::atomic<uint32_t> exceptions;
+  std::atomic<uint32_t> latency[MB_BUCKETS];
+};
+
+struct s_mb_server_stats {
+  s_mb_fc_stats fc[MB_FC_SLOTS];
+  std::atomic<uint32_t> errors[MB_ERRORS];
+  std::atomic<uint32_t> unsampled; // Worker moved to the other core, no latency
+};
+
+s_mb_server_stats mbStats[MBS_COUNT];
+
+uint8_t mbStatSlot(uint8_t fc) {
+  uint8_t slot = 0;
+  while ((slot < eflib::size(mbStatFc)) && (mbStatFc[slot] != fc))
+    ++slot;
+  return slot;
+}
+
+uint8_t mbLatencyBucket(uint32_t us) {
+  const uint8_t bucket = (us == 0) ? 0 : 32 - __builtin_clz(us);
+  return (bucket < MB_BUCKETS) ? bucket : MB_BUCKETS - 1;
+}
+
+// Wraps a worker, registered as &mbTimed<server, worker>
+template<e_mb_server S, ModbusMessage (*F)(ModbusMessage)>
+ModbusMessage mbTimed(ModbusMessage request) {
+  const BaseType_t core = xPortGetCoreID();
+  const uint32_t start = ESP.getCycleCount();
+  ModbusMessage response = F(request);
+  const uint32_t cycles = ESP.getCycleCount() - start;
+
+  s_mb_server_stats& server = mbStats[S];
+  s_mb_fc_stats& fc = server.fc[mbStatSlot(request.getFunctionCode())];
+  fc.requests.fetch_add(1, std::memory_order_relaxed);
+  if (xPortGetCoreID() == core) { // Cycle counters are per core
+    fc.latency[mbLatencyBucket(cycles / getCpuFrequencyMhz())].fetch_add(1, std::memory_order_relaxed);
   } else {
-    std::vector<uint8_t> res((count + 7) / 8, 0x00);
-    for (uint8_t i = 0; i < count; ++i) {
-      if (pcf8574s.readOutput(i + start)) {
-        res[i / 8] |= _BV(i % 8);
+    server.unsampled.fetch_add(1, std::memory_order_relaxed);
+  }
+  if ((response.size() >= 3) && (response.getFunctionCode() & 0x80)) {
+    const uint8_t code = response.data()[2];
+    fc.exceptions.fetch_add(1, std::memory_order_relaxed);
+    server.errors[(code < MB_ERRORS) ? code : 0].fetch_add(1, std::memory_order_relaxed);
+  }
+  return response;
+}
+
+// Input register view, per server: MB_FC_SLOTS blocks of [requests,
+// exceptions, latency buckets], then the exception codes; low 16 bits
+constexpr uint16_t MB_STAT_FC_WORDS = 2 + MB_BUCKETS;
+constexpr uint16_t MB_STAT_SERVER_WORDS = MB_FC_SLOTS * MB_STAT_FC_WORDS + MB_ERRORS;
+
+uint16_t mbStatWord(uint16_t index) {
+  const s_mb_server_stats& server = mbStats[index / MB_STAT_SERVER_WORDS];
+  index %= MB_STAT_SERVER_WORDS;
+  if (index >= MB_FC_SLOTS * MB_STAT_FC_WORDS) {
+    return (uint16_t)server.errors[index - MB_FC_SLOTS * MB_STAT_FC_WORDS];
+  }
+  const s_mb_fc_stats& fc = server.fc[index / MB_STAT_FC_WORDS];
+  index %= MB_STAT_FC_WORDS;
+  return (uint16_t)((index == 0) ? fc.requests : (index == 1) ? fc.exceptions : fc.latency[index - 2]);
+}
+
+// Upper bound, in us, of the bucket holding the given percentile
+uint32_t mbPercentile(const s_mb_fc_stats& fc, uint32_t percent) {
+  uint32_t total = 0;
+  for (const std::atomic<uint32_t>& n : fc.latency)
+    total += n;
+  uint32_t seen = 0;
+  for (uint8_t bucket = 0; bucket < MB_BUCKETS; ++bucket) {
+    seen += fc.latency[bucket];
+    if ((uint64_t)seen * 100 >= (uint64_t)total * percent) {
+      return 1UL << bucket;
+    }
+  }
+  return 1UL << (MB_BUCKETS - 1);
+}
+
+void printModbusStats(Print& device) {
+  static const char* const names[MBS_COUNT] = { "TCP", "RTU", "GATEWAY" };
+  static uint32_t lastRequests[MBS_COUNT][MB_FC_SLOTS];
+  static millis_t lastPrint = 0;
+  const millis_t now = millis();
+  const uint32_t elapsed = max<uint32_t>(now - lastPrint, 1);
+  lastPrint = now;
+
+  device.println(F("[Modbus Stats]"));
+  for (uint8_t srv = 0; srv < MBS_COUNT; ++srv) {
+    const s_mb_server_stats& server = mbStats[srv];
+    for (uint8_t slot = 0; slot < MB_FC_SLOTS; ++slot) {
+      const s_mb_fc_stats& fc = server.fc[slot];
+      const uint32_t requests = fc.requests;
+      if (requests != 0) {
+        device.printf("%s FC%02X requests=%lu (%lu/s) exceptions=%lu p50<%luus p99<%luus\n", names[srv],
+                      (slot < eflib::size(mbStatFc)) ? mbStatFc[slot] : 0xFF, (unsigned long)requests,
+                      (unsigned long)((uint64_t)(requests - lastRequests[srv][slot]) * 1000 / elapsed),
+                      (unsigned long)fc.exceptions, (unsigned long)mbPercentile(fc, 50), (unsigned long)mbPercentile(fc, 99));
+      }
+      lastRequests[srv][slot] = requests;
+    }
+    for (uint8_t code = 0; code < MB_ERRORS; ++code) {
+      if (server.errors[code] != 0) {
+        device.printf("%s exception 0x%02X: %lu\n", names[srv], code, (unsigned long)server.errors[code]);
       }
     }
-    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)res.size(), res);
+    if (server.unsampled != 0) {
+      device.printf("%s unsampled: %lu\n", names[srv], (unsigned long)server.unsampled);
+    }
   }
-  return response;
 }
 
-// Server function to handle FC02=READ_DISCR_INPUT
-ModbusMessage FC02(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
-  uint16_t start = 0;          // Start address
-  uint16_t count = 0;          // # of coils requested
-  request.get(2, start);       // read address from request
-  request.get(4, count);       // read # of words from request
+#pragma endregion MODBUS STATS
+
+#pragma region REGISTER MAP
+
+// Each Modbus table is a constexpr list of address ranges sorted by start,
+// bound to a reader of the snapshot and an optional writer. pos is the
+// position (bit or word) inside the response/request data where the range
+// starts. The generic handlers resolve a request with a binary search and
+// walk the following ranges, so one request may span several sources.
+typedef Error (*MbRead)(const s_image& img, uint16_t offset, uint16_t count, uint8_t* dst, uint16_t pos);
+// Writers only validate and fill their part of cmd, mbWrite() posts it once
+typedef Error (*MbWrite)(const s_image& img, uint16_t offset, uint16_t count, const uint8_t* src, uint16_t pos, s_io_cmd& cmd);
+
+struct MbRange {
+  uint16_t start;
+  uint16_t count;
+  MbRead read;       // nullptr if write only
+  MbWrite write;     // nullptr if read only
+  e_version version; // Version of the data read, responses are cached unless VER_NONE
+  uint16_t base;     // Source address of start, read() and write() get base + offset
+};
 
-  if ((start + count) > pcf8574s.inputs()) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
-  } else {
-    std::vector<uint8_t> res((count + 7) / 8, 0x00);
-    for (uint8_t i = 0; i < count; ++i) {
-      if (pcf8574s.readInput(i + start)) {
-        res[i / 8] |= _BV(i % 8);
+// A register table: sorted ranges, possibly none
+struct MbTable {
+  const MbRange* ranges;
+  uint8_t count;
+};
+
+template<size_t N>
+constexpr MbTable mbTable(const MbRange (&ranges)[N]) {
+  return { ranges, N };
+}
+
+constexpr bool mbSorted(const MbRange* table, size_t n) {
+  return (n < 2) || (((uint32_t)table[0].start + table[0].count <= table[1].start) && mbSorted(table + 1, n - 1));
+}
+
+constexpr uint16_t IR_DIAG = 256; // Input registers with diagnostic counters
+constexpr uint16_t IR_DIAG_COUNT = 7;
+constexpr uint16_t IR_STATS = 512; // Modbus stats, MB_STAT_SERVER_WORDS per e_mb_server
+constexpr uint16_t IR_STATS_COUNT = MBS_COUNT * MB_STAT_SERVER_WORDS;
+
+std::atomic<uint32_t> mbCacheHits { 0 };
+std::atomic<uint32_t> mbCacheMisses { 0 };
+
+Error mbReadOutputs(const s_image& img, uint16_t offset, uint16_t count, uint8_t* dst, uint16_t pos) {
+  if (!blocksOnline(img.healthOut, offset, count)) {
+    return SERVER_DEVICE_FAILURE;
+  }
+  uint8_t bits[Board::outputBlocks];
+  pcf8574_kc868::copyBitsOut(bits, img.outs, offset, count);
+  pcf8574_kc868::copyBitsIn(dst, pos, bits, count);
+  return SUCCESS;
+}
+
+Error mbWriteOutputs(const s_image& img, uint16_t offset, uint16_t count, const uint8_t* src, uint16_t pos, s_io_cmd& cmd) {
+  if (!blocksOnline(img.healthOut, offset, count)) {
+    return SERVER_DEVICE_FAILURE;
+  }
+  uint8_t bits[Board::outputBlocks];
+  pcf8574_kc868::copyBitsOut(bits, src, pos, count);
+  cmd.cmd = e_io_cmd::WRITE_COILS;
+  pcf8574_kc868::copyBitsIn(cmd.coils, pos, bits, count);
+  return SUCCESS;
+}
+
+Error mbReadInputs(const s_image& img, uint16_t offset, uint16_t count, uint8_t* dst, uint16_t pos) {
+  if (!blocksOnline(img.healthIn, offset, count)) {
+    return SERVER_DEVICE_FAILURE;
+  }
+  uint8_t bits[Board::inputBlocks];
+  pcf8574_kc868::copyBitsOut(bits, img.ins, offset, count);
+  pcf8574_kc868::copyBitsIn(dst, pos, bits, count);
+  return SUCCESS;
+}
+
+void mbPutWords(uint8_t* dst, const uint16_t* src, uint16_t count) {
+  for (uint16_t i = 0; i < count; ++i) {
+    dst[2 * i] = (uint8_t)(src[i] >> 8);
+    dst[2 * i + 1] = (uint8_t)(src[i] & 0xFF);
+  }
+}
+
+Error mbReadAnalog(const s_image& img, uint16_t offset, uint16_t count, uint8_t* dst, uint16_t pos) {
+  mbPutWords(dst + 2 * pos, &img.analog[offset], count);
+  return SUCCESS;
+}
+
+Error mbReadDiagnostics(const s_image& img, uint16_t offset, uint16_t count, uint8_t* dst, uint16_t pos) {
+  const uint16_t diag[] = {
+    (uint16_t)pcf8574s.events.overflows,
+    (uint16_t)mbResponses,
+    (uint16_t)mbFrames.exhausted,
+    (uint16_t)(ESP.getMaxAllocHeap() / 1024), // Falls as the heap fragments
+    (uint16_t)(ESP.getFreeHeap() / 1024),
+    (uint16_t)mbCacheHits,
+    (uint16_t)mbCacheMisses,
+  };
+  static_assert(sizeof(diag) / sizeof(diag[0]) == IR_DIAG_COUNT, "IR_DIAG_COUNT mismatch");
+  mbPutWords(dst + 2 * pos, &diag[offset], count);
+  return SUCCESS;
+}
+
+Error mbReadStats(const s_image& img, uint16_t offset, uint16_t count, uint8_t* dst, uint16_t pos) {
+  for (uint16_t i = 0; i < count; ++i) {
+    const uint16_t v = mbStatWord(offset + i);
+    mbPutWords(dst + 2 * (pos + i), &v, 1);
+  }
+  return SUCCESS;
+}
+
+// Holding registers are windows on the I/O register space, addr = base + offset
+Error mbReadRegisters(const s_image& img, uint16_t addr, uint16_t count, uint8_t* dst, uint16_t pos) {
+  for (uint16_t i = 0; i < count; ++i) {
+    const uint16_t v = ioRegister(img.hold, img.outs, addr + i);
+    mbPutWords(dst + 2 * (pos + i), &v, 1);
+  }
+  return SUCCESS;
+}
+
+static_assert(HR_COIL_WORDS <= eflib::size(hold_registers), "A register span must fit in s_io_cmd::regs");
+
+Error mbWriteRegisters(const s_image& img, uint16_t addr, uint16_t count, const uint8_t* src, uint16_t pos, s_io_cmd& cmd) {
+  if (addr >= HR_COILS) { // Coil words, offline output blocks answer like the coils
+    const size_t first = (addr - HR_COILS) * 16;
+    if (!blocksOnline(img.healthOut, first, min<size_t>(count * 16, pcf8574s.outputs() - first))) {
+      return SERVER_DEVICE_FAILURE;
+    }
+  }
+  cmd.cmd = e_io_cmd::WRITE_REGISTERS;
+  for (uint16_t i = 0; i < count; ++i) {
+    cmd.regs[pos + i] = ((uint16_t)src[2 * (pos + i)] << 8) | src[2 * (pos + i) + 1];
+  }
+  return SUCCESS;
+}
+
+constexpr MbRange mbCoils[] = {
+  { 0, Board::outputBlocks * 8, &mbReadOutputs, &mbWriteOutputs, VER_NONE },
+};
+constexpr MbRange mbDiscreteInputs[] = {
+  { 0, Board::inputBlocks * 8, &mbReadInputs, nullptr, VER_NONE },
+};
+constexpr MbRange mbInputRegisters[] = {
+  { 0, eflib::size(analog), &mbReadAnalog, nullptr, VER_ANALOG },
+  { IR_DIAG, IR_DIAG_COUNT, &mbReadDiagnostics, nullptr, VER_NONE },
+  { IR_STATS, IR_STATS_COUNT, &mbReadStats, nullptr, VER_NONE },
+};
+constexpr MbRange mbHoldingRegisters[] = {
+  { 0, HR_TIMER, &mbReadRegisters, &mbWriteRegisters, VER_HOLD, 0 },
+  { HR_TIMER, eflib::size(hold_registers) - HR_TIMER, &mbReadRegisters, &mbWriteRegisters, VER_HOLD, HR_TIMER },
+  { HR_COILS, HR_COIL_WORDS, &mbReadRegisters, &mbWriteRegisters, VER_HOLD, HR_COILS },
+};
+static_assert(mbSorted(mbCoils, eflib::size(mbCoils)), "mbCoils must be sorted");
+static_assert(mbSorted(mbDiscreteInputs, eflib::size(mbDiscreteInputs)), "mbDiscreteInputs must be sorted");
+static_assert(mbSorted(mbInputRegisters, eflib::size(mbInputRegisters)), "mbInputRegisters must be sorted");
+static_assert(mbSorted(mbHoldingRegisters, eflib::size(mbHoldingRegisters)), "mbHoldingRegisters must be sorted");
+
+// Tight maps for the virtual units
+constexpr MbRange mbOutputCoils[] = {
+  { 0, Board::outputBlocks * 8, &mbReadOutputs, &mbWriteOutputs, VER_NONE },
+};
+constexpr MbRange mbOutputWords[] = {
+  { 0, HR_COIL_WORDS, &mbReadRegisters, &mbWriteRegisters, VER_HOLD, HR_COILS },
+};
+constexpr MbRange mbAnalogDiagnostics[] = {
+  { 0, eflib::size(analog), &mbReadAnalog, nullptr, VER_ANALOG },
+  { IR_DIAG, IR_DIAG_COUNT, &mbReadDiagnostics, nullptr, VER_NONE },
+  { IR_STATS, IR_STATS_COUNT, &mbReadStats, nullptr, VER_NONE },
+};
+static_assert(mbSorted(mbAnalogDiagnostics, eflib::size(mbAnalogDiagnostics)), "mbAnalogDiagnostics must be sorted");
+
+// Function codes a unit serves besides the reads of its non empty tables
+enum e_mb_access : uint8_t {
+  MBA_WRITE = 0x01,    // FC05, FC0F, FC06, FC10, FC16, FC17 on its writable ranges
+  MBA_FIFO = 0x02,     // FC18, the event history
+  MBA_SNAPSHOT = 0x04  // FC41
+};
+
+struct MbUnit {
+  MbTable coils;
+  MbTable discrete;
+  MbTable input;
+  MbTable holding;
+  uint8_t access;
+  uint8_t events; // eventMask() of the types its FC18 returns
+};
+
+// Logical slaves: the whole board at settings.mb_id, the virtual units,
+// if enabled, at settings.mb_units_id + index - 1
+constexpr MbUnit mbUnits[] = {
+  // Whole board
+  { mbTable(mbCoils), mbTable(mbDiscreteInputs), mbTable(mbInputRegisters), mbTable(mbHoldingRegisters), MBA_WRITE | MBA_FIFO | MBA_SNAPSHOT, EVM_ALL },
+  // Output bank: coils, and the same outputs as 16 bit words for FC16/FC17
+  { mbTable(mbOutputCoils), { nullptr, 0 }, { nullptr, 0 }, mbTable(mbOutputWords), MBA_WRITE | MBA_SNAPSHOT, 0 },
+  // Input bank, read only, with its edges in the event history
+  { { nullptr, 0 }, mbTable(mbDiscreteInputs), { nullptr, 0 }, { nullptr, 0 }, MBA_FIFO | MBA_SNAPSHOT, eventMask(EV_INPUT) },
+  // Analog inputs and diagnostics, read only
+  { { nullptr, 0 }, { nullptr, 0 }, mbTable(mbAnalogDiagnostics), { nullptr, 0 }, MBA_SNAPSHOT, 0 },
+  // RC433 bridge: received codes through the event history
+  { { nullptr, 0 }, { nullptr, 0 }, { nullptr, 0 }, { nullptr, 0 }, MBA_FIFO, eventMask(EV_RC433) },
+};
+static_assert(eflib::size(mbUnits) == MB_VIRTUAL_UNITS + 1, "MB_VIRTUAL_UNITS mismatch");
+
+// Every holding range is a window on the I/O register space through
+// mbReadRegisters/mbWriteRegisters, and ranges that touch continue it, so
+// FC03, FC06, FC10, FC16 and FC17 reach the same word on every unit and a
+// contiguous request maps to one contiguous span of I/O registers
+constexpr bool mbRegisterMap(const MbRange* t, size_t n) {
+  return (n == 0) ||
+         ((t[0].read == &mbReadRegisters) && ((t[0].write == nullptr) || (t[0].write == &mbWriteRegisters)) &&
+          ioRegisterSpan(t[0].base, t[0].count) &&
+          ((n < 2) || ((uint32_t)t[0].start + t[0].count < t[1].start) || ((uint32_t)t[0].base + t[0].count == t[1].base)) &&
+          mbRegisterMap(t + 1, n - 1));
+}
+constexpr bool mbUnitsMapped(const MbUnit* u, size_t n) {
+  return (n == 0) || (mbRegisterMap(u[0].holding.ranges, u[0].holding.count) && mbUnitsMapped(u + 1, n - 1));
+}
+static_assert(mbUnitsMapped(mbUnits, eflib::size(mbUnits)), "Holding ranges must map the I/O register space");
+
+// Unit id of mbUnits[index], 0 if it is not served
+uint8_t mbUnitId(uint8_t index) {
+  if (index == 0) {
+    return settings.mb_id;
+  }
+  return mbUnitsBaseValid(settings.mb_units_id) ? settings.mb_units_id + index - 1 : 0;
+}
+
+// Unit of the id, nullptr if it is not one of ours
+const MbUnit* mbUnitFor(uint8_t id) {
+  if (id == 0) { // Broadcast, never a unit of ours
+    return nullptr;
+  }
+  if (id == settings.mb_id) {
+    return &mbUnits[0];
+  }
+  if (!mbUnitsBaseValid(settings.mb_units_id)) {
+    return nullptr;
+  }
+  const int index = (int)id - settings.mb_units_id + 1;
+  return ((index >= 1) && (index < (int)eflib::size(mbUnits))) ? &mbUnits[index] : nullptr;
+}
+
+// Workers are only registered for our units
+const MbUnit& mbUnit(const ModbusMessage& request) {
+  return *mbUnitFor(request.getServerID());
+}
+
+// I/O register of addr, in the holding range r resolved for it
+uint16_t mbRegister(const MbRange* r, uint16_t addr) {
+  return r->base + (addr - r->start);
+}
+
+// Range containing addr, or nullptr
+const MbRange* mbFind(const MbRange* table, size_t n, uint16_t addr) {
+  size_t lo = 0;
+  while (n > 0) { // Last range with start <= addr
+    const size_t half = n / 2;
+    if (table[lo + half].start <= addr) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  if ((lo == 0) || (addr >= (uint32_t)table[lo - 1].start + table[lo - 1].count)) {
+    return nullptr;
+  }
+  return &table[lo - 1];
+}
+
+// Checks [start, start + count) is contiguously mapped and accessible,
+// returns its first range
+const MbRange* mbResolve(const MbTable& table, uint16_t start, uint16_t count, bool write) {
+  const MbRange* first = mbFind(table.ranges, table.count, start);
+  if (first == nullptr) {
+    return nullptr;
+  }
+  uint32_t next = start; // First address not yet covered
+  for (const MbRange* r = first; next < (uint32_t)start + count; ++r) {
+    if ((r == table.ranges + table.count) || (r->start > next) || (write ? (r->write == nullptr) : (r->read == nullptr))) {
+      return nullptr;
+    }
+    next = (uint32_t)r->start + r->count;
+  }
+  return first;
+}
+
+// Calls read() or write() of each range covering [start, start + count),
+// with the source address (base + offset) of its part
+template<typename F>
+Error mbForEach(const MbRange* r, uint16_t start, uint16_t count, F f) {
+  uint16_t pos = 0;
+  while (pos < count) {
+    const uint16_t offset = start + pos - r->start;
+    const uint16_t n = min<uint16_t>(count - pos, r->count - offset);
+    const Error e = f(*r, r->base + offset, n, pos);
+    if (e != SUCCESS) {
+      return e;
+    }
+    pos += n;
+    ++r;
+  }
+  return SUCCESS;
+}
+
+// Reads [start, start + count) of table from img into dst (zeroed), as
+// packed bits or big endian words
+Error mbReadImage(const MbTable& table, const s_image& img, uint16_t start, uint16_t count, uint8_t* dst) {
+  const MbRange* r = mbResolve(table, start, count, false);
+  if (r == nullptr) {
+    return ILLEGAL_DATA_ADDRESS;
+  }
+  return mbForEach(r, start, count, [&](const MbRange& range, uint16_t offset, uint16_t n, uint16_t pos) {
+    return range.read(img, offset, n, dst, pos);
+  });
+}
+
+// Serialized FC03/FC04 payloads keyed by (unit, FC, start, count) and valid while
+// the versions of the data they read are unchanged, so a repeated poll is
+// one memcpy. Shared by the TCP and RTU server tasks
+struct s_mb_cached {
+  uint32_t version; // Sum of the versions read, they only grow
+  uint16_t start;
+  uint16_t count;
+  uint8_t unit;
+  uint8_t fc;       // 0 = free entry
+  uint8_t len;
+  uint8_t data[250];
+};
+
+s_mb_cached mbCache[8];
+uint8_t mbCacheNext = 0; // Round robin replacement
+portMUX_TYPE mbCacheMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Version key of [start, start + count), false if any range is not versioned
+bool mbVersion(const MbRange* r, uint16_t start, uint16_t count, const s_image& img, uint32_t& version) {
+  version = 0;
+  return mbForEach(r, start, count, [&](const MbRange& range, uint16_t offset, uint16_t n, uint16_t pos) {
+    version += img.version[range.version];
+    return (range.version == VER_NONE) ? ILLEGAL_FUNCTION : SUCCESS;
+  }) == SUCCESS;
+}
+
+bool mbCacheGet(uint8_t unit, uint8_t fc, uint16_t start, uint16_t count, uint32_t version, uint8_t* dst, uint8_t len) {
+  bool hit = false;
+  portENTER_CRITICAL(&mbCacheMux);
+  for (const s_mb_cached& e : mbCache) {
+    if ((e.unit == unit) && (e.fc == fc) && (e.start == start) && (e.count == count) && (e.version == version) && (e.len == len)) {
+      memcpy(dst, e.data, len);
+      hit = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&mbCacheMux);
+  (hit ? mbCacheHits : mbCacheMisses).fetch_add(1, std::memory_order_relaxed);
+  return hit;
+}
+
+void mbCachePut(uint8_t unit, uint8_t fc, uint16_t start, uint16_t count, uint32_t version, const uint8_t* src, uint8_t len) {
+  if (len > sizeof(mbCache[0].data)) {
+    return;
+  }
+  portENTER_CRITICAL(&mbCacheMux);
+  s_mb_cached* slot = &mbCache[mbCacheNext];
+  for (s_mb_cached& e : mbCache) { // Same key with an older version
+    if ((e.unit == unit) && (e.fc == fc) && (e.start == start) && (e.count == count)) {
+      slot = &e;
+      break;
+    }
+  }
+  if (slot == &mbCache[mbCacheNext]) {
+    mbCacheNext = (mbCacheNext + 1) % eflib::size(mbCache);
+  }
+  slot->unit = unit;
+  slot->fc = fc;
+  slot->start = start;
+  slot->count = count;
+  slot->version = version;
+  slot->len = len;
+  memcpy(slot->data, src, len);
+  portEXIT_CRITICAL(&mbCacheMux);
+}
+
+ModbusMessage mbRead(const ModbusMessage& request, const MbTable& table, bool bits) {
+  MbFrame response(request);
+  uint16_t start = 0;
+  uint16_t count = 0;
+  request.get(2, start, count);
+
+  const MbRange* r = mbResolve(table, start, count, false);
+  if ((count == 0) || (count > (bits ? 2000 : 125))) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (r == nullptr) {
+    response.error(ILLEGAL_DATA_ADDRESS);
+  } else if (response.ok()) {
+    s_image img;
+    ioSnapshot(img);
+    const uint8_t numBytes = bits ? (count + 7) / 8 : count * 2;
+    response.add(numBytes);
+    uint8_t* dst = response.reserve(numBytes);
+    uint32_t version;
+    const bool cacheable = mbVersion(r, start, count, img, version);
+    if (dst == nullptr) {
+      // Too large, the frame already holds the exception
+    } else if (!cacheable || !mbCacheGet(request.getServerID(), request.getFunctionCode(), start, count, version, dst, numBytes)) {
+      memset(dst, 0, numBytes);
+      const Error e = mbReadImage(table, img, start, count, dst);
+      if (e != SUCCESS) {
+        response.error(e);
+      } else if (cacheable) {
+        mbCachePut(request.getServerID(), request.getFunctionCode(), start, count, version, dst, numBytes);
       }
     }
-    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)res.size(), res);
   }
-  return response;
+  return response.message();
+}
+
+// src holds count packed bits or big endian words. Every range validates
+// and fills its part of a single command, so nothing is written unless the
+// whole request is accepted
+Error mbPrepareWrite(const MbTable& table, uint16_t start, uint16_t count, const uint8_t* src, s_io_cmd& cmd) {
+  const MbRange* r = mbResolve(table, start, count, true);
+  if (r == nullptr) {
+    return ILLEGAL_DATA_ADDRESS;
+  }
+  s_image img;
+  ioSnapshot(img);
+  cmd.start = r->base + (start - r->start);
+  cmd.count = count;
+  return mbForEach(r, start, count, [&](const MbRange& range, uint16_t offset, uint16_t n, uint16_t pos) {
+    return range.write(img, offset, n, src, pos, cmd);
+  });
+}
+
+// Applied by the I/O task in one command; the reply is built by the caller
+Error mbWrite(const MbTable& table, uint16_t start, uint16_t count, const uint8_t* src) {
+  s_io_cmd cmd;
+  const Error e = mbPrepareWrite(table, start, count, src, cmd);
+  if (e != SUCCESS) {
+    return e;
+  }
+  return ioPost(cmd) ? SUCCESS : SERVER_DEVICE_BUSY;
+}
+
+#pragma endregion REGISTER MAP
+
+// Server function to handle FC01=READ_COIL
+ModbusMessage FC01(ModbusMessage request) {
+  return mbRead(request, mbUnit(request).coils, true);
+}
+
+// Server function to handle FC02=READ_DISCR_INPUT
+ModbusMessage FC02(ModbusMessage request) {
+  return mbRead(request, mbUnit(request).discrete, true);
+}
+
+// Server function to handle FC03=READ_HOLD_REGISTER
+ModbusMessage FC03(ModbusMessage request) {
+  return mbRead(request, mbUnit(request).holding, false);
+}
+
+// Server function to handle FC04=READ_INPUT_REGISTER
+ModbusMessage FC04(ModbusMessage request) {
+  return mbRead(request, mbUnit(request).input, false);
 }
 
 // Server function to handle FC05=WRITE_COIL
 ModbusMessage FC05(ModbusMessage request) {
-  ModbusMessage response;
+  MbFrame response(request);
   // Request parameters are coil number and 0x0000 (OFF) or 0xFF00 (ON)
   uint16_t start = 0;
   uint16_t state = 0;
   request.get(2, start, state);
 
-  if(start < pcf8574s.outputs()) {
-    if((state == 0x0000) || (state == 0xFF00)) {
-      pcf8574s.writeOutput(start, state == 0xFF00);
-      pcf8574s.flushOutput();
-      response = ECHO_RESPONSE;
+  if((state != 0x0000) && (state != 0xFF00)) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (response.ok()) { // Without a frame the write could not be confirmed
+    const uint8_t bit = (state == 0xFF00) ? 1 : 0;
+    const Error e = mbWrite(mbUnit(request).coils, start, 1, &bit);
+    if (e == SUCCESS) {
+      response.echo(request);
     } else {
-      response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+      response.error(e);
     }
-  } else {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
   }
-  return response;
+  return response.message();
 }
 
 // Server function to handle FC0F=WRITE_MULT_COILS
 ModbusMessage FC0F(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
+  MbFrame response(request);   // The Modbus message we are going to give back
   uint16_t start = 0;
   uint16_t numCoils = 0;
   uint8_t numBytes = 0;
   uint16_t offset = 2;    // Parameters start after serverID and FC
   offset = request.get(offset, start, numCoils, numBytes);
 
-  if (numCoils > numBytes * 8) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
-  } else if (start + numCoils > pcf8574s.outputs()) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
-    return response;
-  } else {
-    vector<uint8_t> coilset;
-    request.get(offset, coilset, numBytes);
-    for (uint8_t i = 0; i < numCoils; ++i)
-      pcf8574s.writeOutput(i + start, coilset[i / 8] & _BV(i % 8));
-    pcf8574s.flushOutput();
-    response.add(request.getServerID(), request.getFunctionCode(), start, numCoils);
+  if ((numCoils == 0) || (numCoils > numBytes * 8) || (offset + numBytes > request.size())) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (response.ok()) {
+    const Error e = mbWrite(mbUnit(request).coils, start, numCoils, request.data() + offset);
+    if (e == SUCCESS) {
+      response.add(start).add(numCoils);
+    } else {
+      response.error(e);
+    }
   }
-  return response;
+  return response.message();
 }
 
-// Server function to handle FC03=READ_HOLD_REGISTER
-ModbusMessage FC03(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
+// Server function to handle FC06=WRITE_HOLD_REGISTER
+ModbusMessage FC06(ModbusMessage request) {
+  MbFrame response(request);   // The Modbus message we are going to give back
+
+  if (request.size() < 6) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (response.ok()) {
+    uint16_t addr = 0;
+    request.get(2, addr);
+    const Error e = mbWrite(mbUnit(request).holding, addr, 1, request.data() + 4);
+    if (e == SUCCESS) {
+      response.echo(request);
+    } else {
+      response.error(e);
+    }
+  }
+  return response.message();
+}
+
+// Server function to handle FC10=WRITE_MULT_REGISTERS
+ModbusMessage FC10(ModbusMessage request) {
+  MbFrame response(request);   // The Modbus message we are going to give back
   uint16_t start = 0;          // Start address
   uint16_t numWords = 0;       // # of words requested
-  request.get(2, start);       // read address from request
-  request.get(4, numWords);    // read # of words from request
+  uint8_t numBytes = 0;
+  uint16_t offset = request.get(2, start, numWords, numBytes);
 
-  if((start + numWords) > eflib::size(hold_registers)) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
-  } else {
-    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(numWords * 2));
-    for(uint8_t i = 0; i < numWords; ++i)
-      response.add((uint16_t)(hold_registers[i + start]));
+  if ((numWords == 0) || (numWords > 123) || (numBytes != numWords * 2) || (offset + numBytes > request.size())) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (response.ok()) {
+    const Error e = mbWrite(mbUnit(request).holding, start, numWords, request.data() + offset);
+    if (e == SUCCESS) {
+      response.add(start).add(numWords);
+    } else {
+      response.error(e);
+    }
   }
-  return response;
+  return response.message();
 }
 
-// Server function to handle FC04=READ_INPUT_REGISTER
-ModbusMessage FC04(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
-  uint16_t start = 0;          // Start address
-  uint16_t numWords = 0;       // # of words requested
-  request.get(2, start);       // read address from request
-  request.get(4, numWords);    // read # of words from request
+// Server function to handle FC16=MASK_WRITE_REGISTER, applied atomically by the I/O task
+ModbusMessage FC16(ModbusMessage request) {
+  MbFrame response(request);
+  uint16_t addr = 0;
+  uint16_t andMask = 0;
+  uint16_t orMask = 0;
+  request.get(2, addr, andMask, orMask);
+
+  const MbTable& table = mbUnit(request).holding;
+  if (request.size() < 8) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (mbResolve(table, addr, 1, false) == nullptr) {
+    response.error(ILLEGAL_DATA_ADDRESS);
+  } else if (response.ok()) {
+    // Validated and mapped by the range writer like FC06, then turned into a mask
+    const uint8_t placeholder[2] = { 0, 0 };
+    s_io_cmd cmd;
+    Error e = mbPrepareWrite(table, addr, 1, placeholder, cmd);
+    if (e == SUCCESS) {
+      cmd.cmd = e_io_cmd::MASK_REGISTER;
+      cmd.regs[0] = andMask;
+      cmd.regs[1] = orMask;
+      e = ioPost(cmd) ? SUCCESS : SERVER_DEVICE_BUSY;
+    }
+    if (e == SUCCESS) {
+      response.add(addr).add(andMask).add(orMask);
+    } else {
+      response.error(e);
+    }
+  }
+  return response.message();
+}
 
-  if ((start + numWords) > eflib::size(analog)) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
-  } else {
-    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(numWords * 2));
-    for (uint8_t i = 0; i < numWords; ++i)
-      response.add((uint16_t)(analog[i + start]));
+// Server function to handle FC17=READ_WRITE_MULT_REGISTERS, the write then
+// the read are applied atomically by the I/O task
+ModbusMessage FC17(ModbusMessage request) {
+  MbFrame response(request);
+  uint16_t readStart = 0;
+  uint16_t readCount = 0;
+  uint16_t writeStart = 0;
+  uint16_t writeCount = 0;
+  uint8_t numBytes = 0;
+  uint16_t offset = request.get(2, readStart, readCount, writeStart, writeCount, numBytes);
+
+  uint16_t reply[eflib::size(hold_registers)];
+  const MbTable& table = mbUnit(request).holding;
+  const MbRange* rRead = mbResolve(table, readStart, readCount, false);
+  if ((readCount == 0) || (readCount > 125) || (writeCount == 0) || (writeCount > 121) ||
+      (numBytes != writeCount * 2) || (offset + numBytes > request.size())) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if ((readCount > eflib::size(reply)) || (rRead == nullptr)) {
+    response.error(ILLEGAL_DATA_ADDRESS);
+  } else if (response.ok()) {
+    // The write part goes through the range writers like FC10
+    s_io_cmd cmd;
+    Error e = mbPrepareWrite(table, writeStart, writeCount, request.data() + offset, cmd);
+    if (e == SUCCESS) {
+      cmd.cmd = e_io_cmd::READ_WRITE_REGISTERS;
+      cmd.readStart = mbRegister(rRead, readStart);
+      cmd.readCount = readCount;
+      e = ioPost(cmd, reply) ? SUCCESS : SERVER_DEVICE_BUSY;
+    }
+    if (e == SUCCESS) {
+      response.add((uint8_t)(readCount * 2));
+      uint8_t* dst = response.reserve(readCount * 2);
+      if (dst != nullptr) {
+        mbPutWords(dst, reply, readCount);
+      }
+    } else {
+      response.error(e);
+    }
   }
-  return response;
+  return response.message();
 }
 
-// Server function to handle FC06=WRITE_HOLD_REGISTER and FC10=WRITE_MULT_REGISTERS
-ModbusMessage FC06(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
-  uint16_t addr = 0;           // Start address
-  uint16_t value = 0;          // # of words requested
-  request.get(2, addr);        // read address from request
-  request.get(4, value);       // read # of words from request
-
-  if(addr >= eflib::size(hold_registers)) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
-  } else {
-    hold_registers[addr] = value;
-    response = ECHO_RESPONSE;
+// Server function to handle FC18=READ_FIFO_QUEUE over the event history:
+// the FIFO pointer address is the sequence number of the first event
+// wanted, each event is 3 registers [seq, type << 12 | index, value].
+// A unit only returns the event types it bridges (MbUnit::events)
+ModbusMessage FC18(ModbusMessage request) {
+  MbFrame response(request);
+  uint16_t from = 0;
+  request.get(2, from);
+
+  if (request.size() < 4) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (response.ok()) {
+    s_event events[10]; // 30 registers, the FIFO holds at most 31
+    const size_t n = readEvents(from, events, eflib::size(events), mbUnit(request).events);
+    response.add((uint16_t)(2 + n * 6)).add((uint16_t)(n * 3));
+    for (size_t i = 0; i < n; ++i)
+      response.add(events[i].seq).add(events[i].what).add(events[i].value);
   }
-  return response;
+  return response.message();
 }
 
+// User defined FC=0x41 reads several tables from one snapshot in a single
+// round trip. Request: [mask] (optional, default all), response: [mask]
+// then for each selected table, in mask bit order, [byte count][data] of
+// the unit's registers mapped contiguously from address 0
+constexpr uint8_t READ_SNAPSHOT = 0x41;
+
+enum e_snapshot_mask : uint8_t {
+  SNAP_COILS = 0x01,    // Coils from 0, packed bits
+  SNAP_DISCRETE = 0x02, // Discrete inputs from 0, packed bits
+  SNAP_HOLDING = 0x04,  // Holding registers from 0
+  SNAP_INPUT = 0x08,    // Input registers from 0
+  SNAP_ALL = 0x0F
+};
 
-// Server function to handle FC06=WRITE_HOLD_REGISTER and FC10=WRITE_MULT_REGISTERS
-ModbusMessage FC10(ModbusMessage request) {
-  ModbusMessage response;      // The Modbus message we are going to give back
-  uint16_t start = 0;          // Start address
-  uint16_t numWords = 0;       // # of words requested
-  uint8_t numBytes = 0;
-  uint16_t offset = request.get(2, start, numWords, numBytes);
+// Length of the contiguous run of ranges starting at address 0
+uint16_t mbSpan(const MbTable& table) {
+  uint32_t next = 0;
+  for (uint8_t i = 0; (i < table.count) && (table.ranges[i].start == next) && (table.ranges[i].read != nullptr); ++i)
+    next += table.ranges[i].count;
+  return (uint16_t)next;
+}
+
+Error mbSnapshotSection(MbFrame& response, const MbTable& table, const s_image& img, bool bits) {
+  const uint16_t count = mbSpan(table);
+  if (count == 0) {
+    response.add((uint8_t)0);
+    return SUCCESS;
+  }
+  const uint16_t numBytes = bits ? (count + 7) / 8 : count * 2;
+  if (numBytes > 0xFF) {
+    return SERVER_DEVICE_FAILURE; // Byte count field is 8 bit
+  }
+  response.add((uint8_t)numBytes);
+  uint8_t* dst = response.reserve(numBytes);
+  if (dst == nullptr) {
+    return SERVER_DEVICE_FAILURE;
+  }
+  memset(dst, 0, numBytes);
+  return mbReadImage(table, img, 0, count, dst);
+}
+
+// Server function to handle FC41=READ_SNAPSHOT
+ModbusMessage FC41(ModbusMessage request) {
+  MbFrame response(request);
+  uint8_t mask = SNAP_ALL;
+  if (request.size() > 2) {
+    request.get(2, mask);
+  }
+
+  if ((mask == 0) || ((mask & ~SNAP_ALL) != 0)) {
+    response.error(ILLEGAL_DATA_VALUE);
+  } else if (response.ok()) {
+    s_image img;
+    ioSnapshot(img);
+    response.add(mask);
+    Error e = SUCCESS;
+    const MbUnit& unit = mbUnit(request);
+    if ((e == SUCCESS) && (mask & SNAP_COILS))
+      e = mbSnapshotSection(response, unit.coils, img, true);
+    if ((e == SUCCESS) && (mask & SNAP_DISCRETE))
+      e = mbSnapshotSection(response, unit.discrete, img, true);
+    if ((e == SUCCESS) && (mask & SNAP_HOLDING))
+      e = mbSnapshotSection(response, unit.holding, img, false);
+    if ((e == SUCCESS) && (mask & SNAP_INPUT))
+      e = mbSnapshotSection(response, unit.input, img, false);
+    if (e != SUCCESS) {
+      response.error(e);
+    }
+  }
+  return response.message();
+}
+
+#pragma region GATEWAY
+
+// Gateway mode: TCP requests for unit ids gw_first_id..gw_last_id (except
+// our own units) are forwarded to the RS485 slaves. Downstream read responses are
+// cached for a per range TTL, so several SCADA clients polling the same
+// data do not each hit the serial bus; any write to a unit drops its cache.
+// Workers run in the TCP connection tasks and wait in ModbusGateway for
+// MBclient's answer.
+
+ModbusClientRTU MBclient;
+
+struct GwTtl {
+  uint8_t unit;   // 0 = any
+  uint8_t fc;     // 0 = any read
+  uint16_t start;
+  uint16_t count;
+  uint16_t ttl;   // ms, 0 = never cached
+};
+
+// First match wins, reads matching no rule live settings.gw_ttl
+constexpr GwTtl gwTtl[] = {
+  { 0, READ_COIL, 0, 0xFFFF, 100 },        // Bits follow the field closely
+  { 0, READ_DISCR_INPUT, 0, 0xFFFF, 100 },
+};
+
+// ModbusGateway's downstream link: the RS485 client, which queues the
+// request and answers through gwOnResponse()
+struct GwRtu {
+  bool send(const ModbusMessage& request, uint32_t token) {
+    return MBclient.addRequest(request, token) == SUCCESS;
+  }
+};
+
+constexpr uint32_t gwTimeout = 500; // Downstream response timeout, ms
+
+uint16_t gwLifetime(uint8_t unit, uint8_t fc, uint16_t start, uint16_t count) {
+  for (const GwTtl& rule : gwTtl) {
+    if (((rule.unit == 0) || (rule.unit == unit)) && ((rule.fc == 0) || (rule.fc == fc)) &&
+        (start >= rule.start) && ((uint32_t)start + count <= (uint32_t)rule.start + rule.count)) {
+      return rule.ttl;
+    }
+  }
+  return settings.gw_ttl;
+}
+
+GwRtu gwRtu;
+ModbusGateway<GwRtu, MB_TCP_CLIENTS, 16, MB_FRAME_SIZE> gateway(gwRtu, gwTimeout, &gwLifetime);
 
-  if ((start + numWords) > eflib::size(hold_registers)) {
-    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+// MBclient callback, in the client's task. Client side errors (timeout,
+// CRC...) come as error codes from TIMEOUT up and count as no answer;
+// slave exceptions are passed on
+void gwOnResponse(ModbusMessage response, uint32_t token) {
+  if (response.getError() >= TIMEOUT) {
+    gateway.complete(token, nullptr, 0);
   } else {
-    for(size_t i = 0; i < numWords; ++i)
-      offset = request.get(offset, hold_registers[i + start]);
-    response.add(request.getServerID(), request.getFunctionCode(), start, numWords);
+    gateway.complete(token, response.data(), response.size());
+  }
+}
+
+// Worker for every FC of the forwarded unit ids: the answer is copied
+// straight into the reply frame
+ModbusMessage gwForward(ModbusMessage request) {
+  MbFrame response(request);
+  if (response.ok()) { // Not forwarded without a frame to answer it
+    const uint16_t len = gateway.forward(request, response.buffer(), MB_FRAME_SIZE);
+    if (len != 0) {
+      response.assign(len);
+    } else {
+      response.error(GATEWAY_TARGET_NO_RESP);
+    }
+  }
+  return response.message();
+}
+
+bool gwEnabled() {
+  return (settings.gw_first_id != 0) && (settings.gw_first_id <= settings.gw_last_id);
+}
+
+void setupGateway() {
+  MBclient.setTimeout(gwTimeout);
+  MBclient.onResponseHandler(&gwOnResponse);
+  MBclient.begin(MBserial, -1, mbFrameGap(settings));
+  for (uint16_t unit = settings.gw_first_id; unit <= settings.gw_last_id; ++unit) {
+    if (mbUnitFor(unit) == nullptr) {
+      MBTcpServer.registerWorker(unit, ANY_FUNCTION_CODE, &mbTimed<MBS_GATEWAY, gwForward>);
+    }
+  }
+}
+
+#pragma endregion GATEWAY
+
+void printModbusDiagnostics(Print& device) {
+  device.printf("Modbus responses: %lu, frame pool exhausted: %lu\n",
+                (unsigned long)mbResponses, (unsigned long)mbFrames.exhausted);
+  const uint32_t hits = mbCacheHits;
+  const uint32_t lookups = hits + mbCacheMisses;
+  device.printf("Read cache hits: %lu/%lu (%lu%%)\n", (unsigned long)hits, (unsigned long)lookups,
+                (unsigned long)(lookups ? (uint64_t)hits * 100 / lookups : 0));
+  if (gwEnabled()) {
+    device.printf("Gateway cache hits: %lu, misses: %lu, downstream failures: %lu\n",
+                  (unsigned long)gateway.cache().hits, (unsigned long)gateway.cache().misses,
+                  (unsigned long)gateway.failures);
+  }
+}
+
+// Registers, for every unit, the workers its tables and access rights allow;
+// eModbus answers ILLEGAL_FUNCTION for the others
+template<e_mb_server S>
+void registerUnits(ModbusServer& server) {
+  for (uint8_t index = 0; index < eflib::size(mbUnits); ++index) {
+    const MbUnit& unit = mbUnits[index];
+    const uint8_t id = mbUnitId(index);
+    if ((id == 0) || (mbUnitFor(id) != &unit)) {
+      continue; // Disabled, or shadowed by the board's own id
+    }
+    const bool write = unit.access & MBA_WRITE;
+    if (unit.coils.count) {
+      server.registerWorker(id, READ_COIL, &mbTimed<S, FC01>);                 // FC=0x01
+      if (write) {
+        server.registerWorker(id, WRITE_COIL, &mbTimed<S, FC05>);              // FC=0x05
+        server.registerWorker(id, WRITE_MULT_COILS, &mbTimed<S, FC0F>);        // FC=0x0F
+      }
+    }
+    if (unit.discrete.count) {
+      server.registerWorker(id, READ_DISCR_INPUT, &mbTimed<S, FC02>);          // FC=0x02
+    }
+    if (unit.holding.count) {
+      server.registerWorker(id, READ_HOLD_REGISTER, &mbTimed<S, FC03>);        // FC=0x03
+      if (write) {
+        server.registerWorker(id, WRITE_HOLD_REGISTER, &mbTimed<S, FC06>);     // FC=0x06
+        server.registerWorker(id, WRITE_MULT_REGISTERS, &mbTimed<S, FC10>);    // FC=0x10
+        server.registerWorker(id, MASK_WRITE_REGISTER, &mbTimed<S, FC16>);     // FC=0x16
+        server.registerWorker(id, R_W_MULT_REGISTERS, &mbTimed<S, FC17>);      // FC=0x17
+      }
+    }
+    if (unit.input.count) {
+      server.registerWorker(id, READ_INPUT_REGISTER, &mbTimed<S, FC04>);       // FC=0x04
+    }
+    if (unit.access & MBA_FIFO) {
+      server.registerWorker(id, READ_FIFO_QUEUE, &mbTimed<S, FC18>);           // FC=0x18
+    }
+    if (unit.access & MBA_SNAPSHOT) {
+      server.registerWorker(id, READ_SNAPSHOT, &mbTimed<S, FC41>);             // FC=0x41
+    }
   }
-  return response;
 }
 
 void setupModbus() {
   if(settings.mb_port) {
-    // Define and start RTU server
-    MBTcpServer.registerWorker(settings.mb_id, READ_COIL, &FC01);             // FC=0x01 for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, READ_DISCR_INPUT, &FC02);      // FC=0x02 for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, READ_HOLD_REGISTER, &FC03);    // FC=0x03 for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, READ_INPUT_REGISTER, &FC04);   // FC=0x04 for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, WRITE_COIL, &FC05);            // FC=0x05 for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, WRITE_MULT_COILS, &FC0F);      // FC=0x0F for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, WRITE_HOLD_REGISTER, &FC06);   // FC=0x06 for serverID=1
-    MBTcpServer.registerWorker(settings.mb_id, WRITE_MULT_REGISTERS, &FC10);  // FC=0x16 for serverID=1
-    MBTcpServer.start(settings.mb_port, settings.mb_id, 20000);
-  }
-  {
-    MBserver.registerWorker(settings.mb_id, READ_COIL, &FC01);                // FC=0x01 for serverID=1
-    MBserver.registerWorker(settings.mb_id, READ_DISCR_INPUT, &FC02);         // FC=0x02 for serverID=1
-    MBserver.registerWorker(settings.mb_id, READ_HOLD_REGISTER, &FC03);       // FC=0x03 for serverID=1
-    MBserver.registerWorker(settings.mb_id, READ_INPUT_REGISTER, &FC04);      // FC=0x04 for serverID=1
-    MBserver.registerWorker(settings.mb_id, WRITE_COIL, &FC05);               // FC=0x05 for serverID=1
-    MBserver.registerWorker(settings.mb_id, WRITE_MULT_COILS, &FC0F);         // FC=0x0F for serverID=1
-    MBserver.registerWorker(settings.mb_id, WRITE_HOLD_REGISTER, &FC06);      // FC=0x06 for serverID=1
-    MBserver.registerWorker(settings.mb_id, WRITE_MULT_REGISTERS, &FC10);     // FC=0x16 for serverID=1
-    MBserver.begin(MBserial);
+    // Define and start TCP server
+    registerUnits<MBS_TCP>(MBTcpServer);
+    if (gwEnabled()) {
+      setupGateway();
+    }
+    MBTcpServer.start(settings.mb_port, MB_TCP_CLIENTS, 20000);
+  }
+  if (!gwEnabled()) { // The RS485 port is either the gateway's or the RTU server's
+    registerUnits<MBS_RTU>(MBserver);
+    MBserver.begin(MBserial, -1, mbFrameGap(settings));
+  }
+}
+
+uint32_t mbSerialConfig(char parity) {
+  switch (parity) {
+    case 'E': return SERIAL_8E1;
+    case 'O': return SERIAL_8O1;
+    default: return SERIAL_8N1;
   }
 }
 
+// Inter frame gap in us: mb_rx_timeout characters of 11 bits, or the
+// standard t3.5 (fixed 1750us above 19200 baud)
+uint32_t mbFrameGap(const s_settings& s) {
+  if (s.mb_rx_timeout) {
+    return (s.mb_rx_timeout * 11 * 1000000UL) / s.mb_baud;
+  }
+  return (s.mb_baud > 19200) ? 1750 : (35 * 11 * 100000UL) / s.mb_baud;
+}
+
 #pragma endregion MODBUS
 
 void setup() {
   serialProg.begin(115200);
   delay(1000);
 
+  for (uint8_t bus = 0; bus < Board::buses; ++bus) {
+    serialProg.printf("Init I2C%u ", bus);
+    if (i2cWires[bus]->begin(Board::sda(bus), Board::scl(bus), 400000UL)) { // 400kHz
+      serialProg.println("OK");
+    } else {
+      serialProg.println("KO");
+    }
+  }
+
+  eeInit(EE_SIZE);
+  loadSettings(0, settings);
+  loadRcActions();
+
   if(MBserial != serialProg) {
-    MBserial.setPins(RX_RS485, TX_RS485, GPIO_NUM_NC, GPIO_NUM_NC);
-    MBserial.begin(115200, SERIAL_8N1);
+    MBserial.setRxBufferSize(512);
+    MBserial.begin(settings.mb_baud, mbSerialConfig(settings.mb_parity), RX_RS485, TX_RS485);
+    // eModbus finds frame ends by timing byte arrival against the frame
+    // gap. The driver's default 2 symbol RX timeout stays: bytes reach the
+    // RX buffer well within a gap, a longer one would only delay them
     MBserial.println(F("MBserial port is initializzed"));
   } else {
     serialProg.println(F("MBserial port not initializzed"));
   }
 
-  serialProg.print("Init I2C ");
-  if (Wire.begin(SDA_I2C, SCL_I2C, 400000UL)) { // 400kHz
-		serialProg.println("OK");
-	} else {
-		serialProg.println("KO");
-	}
-
-  eeInit(EE_SIZE);
-  loadSettings(0, settings);
-
   serialProg.print("Init PCF8574 ");
 	if (pcf8574s.begin()) {
 		serialProg.println("OK");
 	} else {
 		serialProg.println("KO");
 	}
+  #if defined(INT_I2C)
+    pcf8574s.enableInterrupt(INT_I2C, 1000);
+  #endif
+
+  // From now on I2C is owned by one engine task per bus, so buses are
+  // scanned in parallel and callers never block on the bus
+  for (uint8_t bus = 0; bus < Board::buses; ++bus) {
+    serialProg.printf("Init I2C%u engine ", bus);
+    I2CEngine* engine = new I2CEngine(*new I2CBusWire(*i2cWires[bus]));
+    if (engine->begin()) {
+      pcf8574s.attachEngine(engine, bus);
+      serialProg.println("OK");
+    } else {
+      serialProg.println("KO");
+    }
+  }
 
   setupETH(serialProg);
 
   setupModbus();
   setupAnalog();
   setupRC433();
+  timedOutputs.begin(millis());
+
+  serialProg.print("Init IO task ");
+  if (setupIO()) {
+    serialProg.println("OK");
+  } else {
+    serialProg.println("KO");
+  }
 }
 
 void loop() {
   execCommand(serialProg);
   yield();
   millis_t now = millis();
+  updateRcLearn(serialProg, now);
   updateRC433(serialProg, now);
-  pcf8574s.updateInput();
-  updateAnalog(now);
 
   //if (pcf8574s.updateInput() >= 0) { // Was executed (could have an error if > 0)
   //  static_assert(eflib::size(pcf8574s.ins) == eflib::size(pcf8574s.outs));
@@ -0,0 +1,7 @@
+#if !defined(_ARDUINO_SHIM_H_)
+#define _ARDUINO_SHIM_H_
+
+// Native tests only, see WProgram.h
+#include "WProgram.h"
+
+#endif
@@ -0,0 +1,88 @@
+#if !defined(_WPROGRAM_SHIM_H_)
+#define _WPROGRAM_SHIM_H_
+
+// Native tests only: the Arduino calls RCSwitch makes, which includes this
+// header when no framework is defined (Arduino.h includes it for the
+// others). Pin writes and delays are recorded as a level trace, micros()
+// is a clock the test advances, digitalRead() returns levels the test sets
+// and the last attached ISR is kept so edges can be replayed through it
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define LOW 0
+#define HIGH 1
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define CHANGE 0x03
+#define FALLING 0x02
+#define PROGMEM
+#define IRAM_ATTR
+#define _BV(bit) (1 << (bit))
+#define digitalPinToInterrupt(pin) (pin)
+#define memcpy_P(dest, src, num) memcpy((dest), (src), (num))
+
+namespace arduino_shim {
+  struct Level {
+    int level;
+    unsigned long us;
+  };
+
+  struct State {
+    unsigned long now = 0;
+    int level = LOW;
+    std::vector<Level> trace; // One entry per delayMicroseconds()
+    void (*isr)(void*) = nullptr;
+    void* isrArg = nullptr;
+    int inputs[64]; // digitalRead() levels
+
+    State() {
+      for (int& l : inputs) {
+        l = HIGH; // Pulled up
+      }
+    }
+  };
+
+  inline State& state() {
+    static State s;
+    return s;
+  }
+  // Advances the clock by us, then raises the receiver interrupt
+  inline void edge(unsigned long us) {
+    State& s = state();
+    s.now += us;
+    if (s.isr != nullptr) {
+      s.isr(s.isrArg);
+    }
+  }
+}
+
+inline unsigned long micros() {
+  return arduino_shim::state().now;
+}
+inline unsigned long millis() {
+  return arduino_shim::state().now / 1000;
+}
+inline void pinMode(int, int) {}
+inline int digitalRead(int pin) {
+  return arduino_shim::state().inputs[pin];
+}
+inline void digitalWrite(int, int level) {
+  arduino_shim::state().level = level;
+}
+inline void delayMicroseconds(unsigned int us) {
+  arduino_shim::State& s = arduino_shim::state();
+  s.trace.push_back({ s.level, us });
+  s.now += us;
+}
+inline void attachInterruptArg(int, void (*isr)(void*), void* arg, int) {
+  arduino_shim::state().isr = isr;
+  arduino_shim::state().isrArg = arg;
+}
+inline void detachInterrupt(int) {
+  arduino_shim::state().isr = nullptr;
+}
+
+#endif
@@ -0,0 +1,225 @@
+#include <unity.h>
+#include <ef_queue.hpp>
+#include <ef_pool.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Host stress tests for the lock-free primitives shared by the I/O owner
+// task and its clients: real threads, so races show up as broken orders
+// or torn values
+
+void setUp() {}
+void tearDown() {}
+
+void test_spsc_ring_fills_and_drains() {
+  eflib::SpscRing<uint32_t, 4> ring;
+  for (uint32_t i = 0; i < 4; ++i) {
+    TEST_ASSERT_TRUE(ring.push(i));
+  }
+  TEST_ASSERT_FALSE(ring.push(4));
+  TEST_ASSERT_EQUAL_UINT32(1, ring.overflows.load());
+  uint32_t v;
+  for (uint32_t i = 0; i < 4; ++i) {
+    TEST_ASSERT_TRUE(ring.pop(v));
+    TEST_ASSERT_EQUAL_UINT32(i, v);
+  }
+  TEST_ASSERT_FALSE(ring.pop(v));
+  TEST_ASSERT_TRUE(ring.empty());
+}
+
+void test_spsc_ring_threads() {
+  constexpr uint32_t COUNT = 200000;
+  eflib::SpscRing<uint32_t, 64> ring;
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < COUNT; ) {
+      if (ring.push(i)) {
+        i += 1;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint32_t expected = 0;
+  uint32_t v;
+  while (expected < COUNT) {
+    if (ring.pop(v)) {
+      if (v != expected) {
+        break;
+      }
+      expected += 1;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  TEST_ASSERT_EQUAL_UINT32(COUNT, expected);
+}
+
+void test_mpsc_queue_tickets() {
+  eflib::MpscQueue<uint32_t, 4> queue;
+  uint32_t ticket = 0;
+  for (uint32_t i = 0; i < 4; ++i) {
+    TEST_ASSERT_TRUE(queue.push(10 + i, &ticket));
+    TEST_ASSERT_EQUAL_UINT32(i, ticket);
+  }
+  TEST_ASSERT_FALSE(queue.push(99));
+  TEST_ASSERT_EQUAL_UINT32(1, queue.overflows.load());
+  uint32_t v;
+  TEST_ASSERT_TRUE(queue.pop(v));
+  TEST_ASSERT_EQUAL_UINT32(10, v);
+  TEST_ASSERT_TRUE(queue.push(14, &ticket));
+  TEST_ASSERT_EQUAL_UINT32(4, ticket);
+}
+
+// Every producer pushes its own increasing sequence: the consumer must get
+// all of them, each producer's in order, whatever the interleaving
+void test_mpsc_queue_producers() {
+  constexpr uint32_t PRODUCERS = 4;
+  constexpr uint32_t COUNT = 100000;
+  eflib::MpscQueue<uint32_t, 16> queue;
+  std::vector<std::thread> producers;
+  for (uint32_t p = 0; p < PRODUCERS; ++p) {
+    producers.emplace_back([&queue, p] {
+      for (uint32_t i = 0; i < COUNT; ) {
+        if (queue.push((p << 24) | i)) {
+          i += 1;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  uint32_t next[PRODUCERS] = {};
+  uint32_t received = 0;
+  bool ordered = true;
+  uint32_t v;
+  while (received < PRODUCERS * COUNT) {
+    if (queue.pop(v)) {
+      const uint32_t p = v >> 24;
+      ordered = ordered && (p < PRODUCERS) && ((v & 0xFFFFFF) == next[p]);
+      next[p & (PRODUCERS - 1)] += 1;
+      received += 1;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  for (std::thread& t : producers) {
+    t.join();
+  }
+  TEST_ASSERT_TRUE(ordered);
+  for (uint32_t p = 0; p < PRODUCERS; ++p) {
+    TEST_ASSERT_EQUAL_UINT32(COUNT, next[p]);
+  }
+  TEST_ASSERT_FALSE(queue.pop(v));
+}
+
+// Process image stand-in: every field derives from seq, so a torn copy
+// (half old, half new) never passes check()
+struct Image {
+  uint32_t seq;
+  uint16_t words[24];
+  uint32_t check;
+
+  void fill(uint32_t s) {
+    seq = s;
+    for (size_t i = 0; i < 24; ++i) {
+      words[i] = (uint16_t)(s * (i + 1));
+    }
+    check = ~s;
+  }
+  bool consistent() const {
+    for (size_t i = 0; i < 24; ++i) {
+      if (words[i] != (uint16_t)(seq * (i + 1))) {
+        return false;
+      }
+    }
+    return check == ~seq;
+  }
+};
+
+void test_seqlock_readers_and_writer() {
+  constexpr uint32_t WRITES = 200000;
+  constexpr uint32_t READERS = 3;
+  eflib::SeqLock<Image> lock;
+  Image first;
+  first.fill(0);
+  lock.write(first);
+
+  std::atomic<bool> done { false };
+  std::atomic<uint32_t> torn { 0 };
+  std::atomic<uint32_t> backwards { 0 };
+  std::vector<std::thread> readers;
+  for (uint32_t r = 0; r < READERS; ++r) {
+    readers.emplace_back([&] {
+      uint32_t last = 0;
+      Image img;
+      while (!done.load(std::memory_order_relaxed)) {
+        lock.read(img, [] { std::this_thread::yield(); });
+        if (!img.consistent()) {
+          torn.fetch_add(1);
+        }
+        if (img.seq < last) {
+          backwards.fetch_add(1);
+        }
+        last = img.seq;
+      }
+    });
+  }
+  Image img;
+  for (uint32_t s = 1; s <= WRITES; ++s) {
+    img.fill(s);
+    lock.write(img);
+  }
+  done = true;
+  for (std::thread& t : readers) {
+    t.join();
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, torn.load());
+  TEST_ASSERT_EQUAL_UINT32(0, backwards.load());
+  TEST_ASSERT_EQUAL_UINT32(WRITES + 1, lock.version());
+}
+
+void test_buffer_pool_threads() {
+  constexpr uint32_t ROUNDS = 50000;
+  eflib::BufferPool<4, 16> pool;
+  std::atomic<uint32_t> clobbered { 0 };
+  std::vector<std::thread> users;
+  for (uint8_t id = 1; id <= 6; ++id) {
+    users.emplace_back([&pool, &clobbered, id] {
+      for (uint32_t i = 0; i < ROUNDS; ++i) {
+        uint8_t* b = pool.acquire();
+        if (b == nullptr) {
+          continue;
+        }
+        memset(b, id, 16);
+        std::this_thread::yield();
+        for (size_t k = 0; k < 16; ++k) {
+          if (b[k] != id) {
+            clobbered.fetch_add(1);
+            break;
+          }
+        }
+        pool.release(b);
+      }
+    });
+  }
+  for (std::thread& t : users) {
+    t.join();
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, clobbered.load());
+  for (size_t i = 0; i < pool.capacity(); ++i) {
+    TEST_ASSERT_NOT_NULL(pool.acquire()); // All released
+  }
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_spsc_ring_fills_and_drains);
+  RUN_TEST(test_spsc_ring_threads);
+  RUN_TEST(test_mpsc_queue_tickets);
+  RUN_TEST(test_mpsc_queue_producers);
+  RUN_TEST(test_seqlock_readers_and_writer);
+  RUN_TEST(test_buffer_pool_threads);
+  return UNITY_END();
+}
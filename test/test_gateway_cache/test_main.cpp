@@ -0,0 +1,124 @@
+#include <unity.h>
+#include <GatewayCache.hpp>
+
+// The gateway's downstream read cache: TTLs, keys, invalidation on
+// writes and reuse when full
+
+using Cache = GatewayCache<4, 16>;
+
+static const uint8_t response[] = { 0x04, 0x12, 0x34, 0x56, 0x78 }; // Byte count + 2 registers
+
+static bool hit(Cache& cache, const Cache::Key& key, uint32_t now) {
+  uint16_t len = 0;
+  return cache.find(key, now, len) != nullptr;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_hit_until_ttl() {
+  Cache cache;
+  const Cache::Key key = { 5, 0x03, 100, 2 };
+  TEST_ASSERT_FALSE(hit(cache, key, 1000));
+  TEST_ASSERT_TRUE(cache.store(key, 1000, 250, response, sizeof(response)));
+
+  uint16_t len = 0;
+  const uint8_t* data = cache.find(key, 1249, len);
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL_UINT16(sizeof(response), len);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(response, data, sizeof(response));
+  TEST_ASSERT_FALSE(hit(cache, key, 1250));
+  TEST_ASSERT_EQUAL_UINT32(1, cache.hits);
+  TEST_ASSERT_EQUAL_UINT32(2, cache.misses);
+}
+
+void test_ttl_across_millis_wrap() {
+  Cache cache;
+  const Cache::Key key = { 1, 0x04, 0, 8 };
+  cache.store(key, 0xFFFFFF00UL, 0x200, response, sizeof(response));
+  TEST_ASSERT_TRUE(hit(cache, key, 0x00000050UL));
+  TEST_ASSERT_FALSE(hit(cache, key, 0x00000100UL));
+}
+
+void test_key_must_match_exactly() {
+  Cache cache;
+  cache.store({ 5, 0x03, 100, 2 }, 0, 1000, response, sizeof(response));
+  TEST_ASSERT_FALSE(hit(cache, { 6, 0x03, 100, 2 }, 10));
+  TEST_ASSERT_FALSE(hit(cache, { 5, 0x04, 100, 2 }, 10));
+  TEST_ASSERT_FALSE(hit(cache, { 5, 0x03, 101, 2 }, 10));
+  TEST_ASSERT_FALSE(hit(cache, { 5, 0x03, 100, 1 }, 10));
+  TEST_ASSERT_TRUE(hit(cache, { 5, 0x03, 100, 2 }, 10));
+}
+
+void test_store_refreshes_entry() {
+  Cache cache;
+  const Cache::Key key = { 2, 0x03, 0, 1 };
+  const uint8_t newer[] = { 0x02, 0xAB, 0xCD };
+  cache.store(key, 0, 100, response, sizeof(response));
+  cache.store(key, 90, 100, newer, sizeof(newer));
+  uint16_t len = 0;
+  const uint8_t* data = cache.find(key, 150, len);
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL_UINT16(sizeof(newer), len);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(newer, data, sizeof(newer));
+}
+
+void test_invalidate_drops_one_unit() {
+  Cache cache;
+  cache.store({ 3, 0x03, 0, 2 }, 0, 1000, response, sizeof(response));
+  cache.store({ 3, 0x01, 0, 16 }, 0, 1000, response, sizeof(response));
+  cache.store({ 4, 0x03, 0, 2 }, 0, 1000, response, sizeof(response));
+  cache.invalidate(3);
+  TEST_ASSERT_FALSE(hit(cache, { 3, 0x03, 0, 2 }, 10));
+  TEST_ASSERT_FALSE(hit(cache, { 3, 0x01, 0, 16 }, 10));
+  TEST_ASSERT_TRUE(hit(cache, { 4, 0x03, 0, 2 }, 10));
+}
+
+void test_full_cache_reuses_first_to_expire() {
+  Cache cache;
+  const uint16_t ttls[Cache::capacity()] = { 400, 100, 300, 200 };
+  for (uint16_t i = 0; i < Cache::capacity(); ++i) {
+    cache.store({ 1, 0x03, i, 1 }, 0, ttls[i], response, sizeof(response));
+  }
+  cache.store({ 1, 0x03, 99, 1 }, 0, 500, response, sizeof(response));
+  TEST_ASSERT_FALSE(hit(cache, { 1, 0x03, 1, 1 }, 10)); // ttl 100 was reused
+  TEST_ASSERT_TRUE(hit(cache, { 1, 0x03, 0, 1 }, 10));
+  TEST_ASSERT_TRUE(hit(cache, { 1, 0x03, 2, 1 }, 10));
+  TEST_ASSERT_TRUE(hit(cache, { 1, 0x03, 3, 1 }, 10));
+  TEST_ASSERT_TRUE(hit(cache, { 1, 0x03, 99, 1 }, 10));
+}
+
+void test_misses_do_not_evict() {
+  Cache cache;
+  for (uint16_t i = 0; i < Cache::capacity(); ++i) {
+    cache.store({ 1, 0x03, i, 1 }, 0, 1000, response, sizeof(response));
+  }
+  for (uint16_t i = 100; i < 120; ++i) {
+    hit(cache, { 1, 0x03, i, 1 }, 10);
+  }
+  for (uint16_t i = 0; i < Cache::capacity(); ++i) {
+    TEST_ASSERT_TRUE(hit(cache, { 1, 0x03, i, 1 }, 10));
+  }
+}
+
+void test_refuses_uncacheable() {
+  Cache cache;
+  uint8_t big[17] = {};
+  TEST_ASSERT_FALSE(cache.store({ 1, 0x03, 0, 1 }, 0, 0, response, sizeof(response))); // TTL 0
+  TEST_ASSERT_FALSE(cache.store({ 1, 0x03, 0, 1 }, 0, 100, response, 0));
+  TEST_ASSERT_FALSE(cache.store({ 1, 0x03, 0, 1 }, 0, 100, big, sizeof(big)));
+  TEST_ASSERT_FALSE(hit(cache, { 1, 0x03, 0, 1 }, 10));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_hit_until_ttl);
+  RUN_TEST(test_ttl_across_millis_wrap);
+  RUN_TEST(test_key_must_match_exactly);
+  RUN_TEST(test_store_refreshes_entry);
+  RUN_TEST(test_invalidate_drops_one_unit);
+  RUN_TEST(test_full_cache_reuses_first_to_expire);
+  RUN_TEST(test_misses_do_not_evict);
+  RUN_TEST(test_refuses_uncacheable);
+  return UNITY_END();
+}
@@ -0,0 +1,179 @@
+#include <unity.h>
+#include <I2CEngine.hpp>
+#include <I2CBusMock.hpp>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// I2CEngine on the host: transactions run against I2CBusMock, process()
+// stands in for the engine task
+
+struct Done {
+  uint32_t calls = 0;
+  uint32_t failures = 0;
+  uint8_t lastTag = 0;
+  uint8_t lastData = 0;
+};
+
+static void onDone(const I2CTransaction& t, bool ok) {
+  Done* d = static_cast<Done*>(t.ctx);
+  d->calls += 1;
+  d->failures += ok ? 0 : 1;
+  d->lastTag = t.tag;
+  d->lastData = t.data[0];
+}
+
+static I2CTransaction transaction(uint8_t addr, bool read, uint8_t value, uint8_t tag, Done* done) {
+  I2CTransaction t = {};
+  t.addr = addr;
+  t.read = read;
+  t.len = 1;
+  t.data[0] = value;
+  t.tag = tag;
+  t.done = (done != nullptr) ? onDone : nullptr;
+  t.ctx = done;
+  return t;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_write_then_read_back() {
+  I2CBusMock bus;
+  bus.attach(0x24);
+  I2CEngine engine(bus);
+  Done done;
+  TEST_ASSERT_TRUE(engine.submit(transaction(0x24, false, 0x5A, 1, &done)));
+  TEST_ASSERT_TRUE(engine.submit(transaction(0x24, true, 0x00, 2, &done)));
+  TEST_ASSERT_EQUAL(2, engine.pending());
+  TEST_ASSERT_EQUAL(0, bus.writes); // Nothing touches the bus before process()
+
+  TEST_ASSERT_TRUE(engine.process());
+  TEST_ASSERT_EQUAL_UINT8(0x5A, bus.value[0x24]);
+  TEST_ASSERT_TRUE(engine.process());
+  TEST_ASSERT_FALSE(engine.process());
+
+  TEST_ASSERT_EQUAL_UINT32(2, done.calls);
+  TEST_ASSERT_EQUAL_UINT32(0, done.failures);
+  TEST_ASSERT_EQUAL_UINT8(2, done.lastTag);
+  TEST_ASSERT_EQUAL_UINT8(0x5A, done.lastData);
+  TEST_ASSERT_EQUAL_UINT32(2, engine.completed);
+}
+
+void test_missing_device_fails() {
+  I2CBusMock bus;
+  I2CEngine engine(bus);
+  Done done;
+  engine.submit(transaction(0x21, true, 0, 7, &done));
+  engine.submit(transaction(0x21, false, 0xFF, 8, nullptr));
+  while (engine.process()) {}
+  TEST_ASSERT_EQUAL_UINT32(1, done.calls);
+  TEST_ASSERT_EQUAL_UINT32(1, done.failures);
+  TEST_ASSERT_EQUAL_UINT32(2, engine.failed);
+  TEST_ASSERT_EQUAL_UINT32(0, engine.completed);
+}
+
+void test_full_queue_drops() {
+  I2CBusMock bus;
+  bus.attach(0x22);
+  I2CEngine engine(bus);
+  for (uint8_t i = 0; i < I2C_ENGINE_QUEUE_LEN; ++i) {
+    TEST_ASSERT_TRUE(engine.submit(transaction(0x22, false, i, i, nullptr)));
+  }
+  TEST_ASSERT_FALSE(engine.submit(transaction(0x22, false, 0xEE, 0, nullptr)));
+  TEST_ASSERT_EQUAL_UINT32(1, engine.dropped);
+  while (engine.process()) {}
+  // In submission order: the last write wins
+  TEST_ASSERT_EQUAL_UINT8(I2C_ENGINE_QUEUE_LEN - 1, bus.value[0x22]);
+  TEST_ASSERT_EQUAL_UINT32(I2C_ENGINE_QUEUE_LEN, engine.completed);
+}
+
+void test_oversized_transfer_is_clamped() {
+  I2CBusMock bus;
+  bus.attach(0x20, 0x33);
+  I2CEngine engine(bus);
+  I2CTransaction t = transaction(0x20, true, 0, 0, nullptr);
+  t.len = I2C_ENGINE_MAX_DATA + 10;
+  engine.submit(t);
+  TEST_ASSERT_TRUE(engine.process());
+  TEST_ASSERT_EQUAL_UINT32(1, engine.completed);
+}
+
+// Several submitters against one engine thread, as loop(), the Modbus
+// workers and ioTask do on the target
+void test_concurrent_submitters() {
+  constexpr uint32_t SUBMITTERS = 3;
+  constexpr uint32_t COUNT = 20000;
+  I2CBusMock bus;
+  for (uint8_t a = 0; a < SUBMITTERS; ++a) {
+    bus.attach(0x20 + a);
+  }
+  I2CEngine engine(bus);
+  std::atomic<uint32_t> callbacks { 0 };
+  std::atomic<bool> stop { false };
+  std::thread worker([&] {
+    while (!stop.load()) {
+      if (!engine.process()) {
+        std::this_thread::yield();
+      }
+    }
+    while (engine.process()) {}
+  });
+  std::vector<std::thread> submitters;
+  for (uint8_t a = 0; a < SUBMITTERS; ++a) {
+    submitters.emplace_back([&engine, &callbacks, a] {
+      for (uint32_t i = 0; i < COUNT; ) {
+        I2CTransaction t = transaction(0x20 + a, (i & 1) != 0, (uint8_t)i, a, nullptr);
+        t.done = [](const I2CTransaction& t, bool ok) {
+          if (ok) {
+            static_cast<std::atomic<uint32_t>*>(t.ctx)->fetch_add(1);
+          }
+        };
+        t.ctx = &callbacks;
+        if (engine.submit(t)) {
+          i += 1;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (std::thread& t : submitters) {
+    t.join();
+  }
+  stop = true;
+  worker.join();
+  TEST_ASSERT_EQUAL_UINT32(SUBMITTERS * COUNT, callbacks.load());
+  TEST_ASSERT_EQUAL_UINT32(SUBMITTERS * COUNT, engine.completed);
+  TEST_ASSERT_EQUAL_UINT32(0, engine.failed);
+}
+
+// Not a pass/fail check: engine overhead per transaction on the mock bus
+void test_benchmark() {
+  constexpr uint32_t COUNT = 200000;
+  I2CBusMock bus;
+  bus.attach(0x24);
+  I2CEngine engine(bus);
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < COUNT; ++i) {
+    engine.submit(transaction(0x24, false, (uint8_t)i, 0, nullptr));
+    engine.process();
+  }
+  const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  char msg[64];
+  snprintf(msg, sizeof(msg), "submit + process: %.0f ns/transaction", ns / COUNT);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL_UINT32(COUNT, engine.completed);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_write_then_read_back);
+  RUN_TEST(test_missing_device_fails);
+  RUN_TEST(test_full_queue_drops);
+  RUN_TEST(test_oversized_transfer_is_clamped);
+  RUN_TEST(test_concurrent_submitters);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,328 @@
+#include <unity.h>
+#include <ModbusGateway.hpp>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The gateway's wait slots, tokens and cache over a pty loopback: an RTU
+// link on the master side (one request at a time, CRC framed, timeout,
+// as ModbusClientRTU) and a holding register slave on the other
+
+struct Adu {
+  std::vector<uint8_t> bytes;
+
+  const uint8_t* data() const {
+    return bytes.data();
+  }
+  uint16_t size() const {
+    return (uint16_t)bytes.size();
+  }
+};
+
+static uint16_t crc16(const uint8_t* data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+}
+
+static void writeFrame(int fd, std::vector<uint8_t> frame) {
+  const uint16_t crc = crc16(frame.data(), frame.size());
+  frame.push_back(crc & 0xFF);
+  frame.push_back(crc >> 8);
+  const ssize_t n = write(fd, frame.data(), frame.size()); // A pty takes a whole frame
+  (void)n;
+}
+
+// Bytes up to a 3 ms gap, CRC checked and dropped; 0 when nothing came
+// within timeoutMs or the CRC is wrong
+static size_t readFrame(int fd, uint8_t* buff, size_t size, int timeoutMs) {
+  size_t len = 0;
+  pollfd p = { fd, POLLIN, 0 };
+  while ((len < size) && (poll(&p, 1, (len == 0) ? timeoutMs : 3) > 0)) {
+    const ssize_t n = read(fd, buff + len, size - len);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  if ((len < 4) || (crc16(buff, len - 2) != (buff[len - 2] | (buff[len - 1] << 8)))) {
+    return 0;
+  }
+  return len - 2;
+}
+
+static uint32_t ttl = 0; // For every read
+
+static uint16_t lifetime(uint8_t, uint8_t, uint16_t, uint16_t) {
+  return ttl;
+}
+
+class RtuLink;
+using Gateway = ModbusGateway<RtuLink, 4>;
+
+// Master side: queued requests go out one by one, each answer (or its
+// absence after timeoutMs) is handed to the gateway from the link thread
+class RtuLink {
+  public:
+    RtuLink(int fd, int timeoutMs) : _fd(fd), _timeout(timeoutMs), _thread(&RtuLink::run, this) {}
+    ~RtuLink() {
+      _stop = true;
+      _cv.notify_one();
+      _thread.join();
+    }
+    bool send(const Adu& request, uint32_t token) {
+      std::lock_guard<std::mutex> guard(_lock);
+      if (_queue.size() >= 8) {
+        return false;
+      }
+      _queue.push_back({ request.bytes, token });
+      _cv.notify_one();
+      return true;
+    }
+
+    Gateway* gateway = nullptr;
+  private:
+    struct Entry {
+      std::vector<uint8_t> adu;
+      uint32_t token;
+    };
+
+    void run() {
+      while (true) {
+        Entry e;
+        {
+          std::unique_lock<std::mutex> guard(_lock);
+          _cv.wait(guard, [this] { return _stop || !_queue.empty(); });
+          if (_stop) {
+            return;
+          }
+          e = _queue.front();
+          _queue.pop_front();
+        }
+        writeFrame(_fd, e.adu);
+        uint8_t answer[256];
+        const size_t len = readFrame(_fd, answer, sizeof(answer), _timeout);
+        gateway->complete(e.token, answer, len);
+      }
+    }
+
+    const int _fd;
+    const int _timeout;
+    std::mutex _lock;
+    std::condition_variable _cv;
+    std::deque<Entry> _queue;
+    std::atomic<bool> _stop { false };
+    std::thread _thread;
+};
+
+// Unit 1 with 32 holding registers: FC 0x03 and 0x06, exception 0x02
+// past the end, 0x01 for any other FC
+class Slave {
+  public:
+    explicit Slave(int fd) : _fd(fd), _thread(&Slave::run, this) {
+      for (uint16_t i = 0; i < 32; ++i) {
+        regs[i] = 0x1000 + i;
+      }
+    }
+    ~Slave() {
+      _stop = true;
+      _thread.join();
+    }
+
+    uint16_t regs[32];
+    std::atomic<uint32_t> requests { 0 };
+    std::atomic<bool> silent { false };
+    std::atomic<int> delayMs { 0 };
+  private:
+    void run() {
+      while (!_stop) {
+        uint8_t req[256];
+        const size_t len = readFrame(_fd, req, sizeof(req), 10);
+        if ((len < 6) || (req[0] != 1)) {
+          continue;
+        }
+        requests += 1;
+        if (silent) {
+          continue;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+        const uint16_t start = (req[2] << 8) | req[3];
+        const uint16_t value = (req[4] << 8) | req[5];
+        std::vector<uint8_t> resp = { req[0], req[1] };
+        if ((req[1] == 0x03) && (start + value <= 32)) {
+          resp.push_back(value * 2);
+          for (uint16_t i = start; i < start + value; ++i) {
+            resp.push_back(regs[i] >> 8);
+            resp.push_back(regs[i] & 0xFF);
+          }
+        } else if ((req[1] == 0x06) && (start < 32)) {
+          regs[start] = value;
+          resp.insert(resp.end(), req + 2, req + 6);
+        } else {
+          resp[1] |= 0x80;
+          resp.push_back((req[1] == 0x03) || (req[1] == 0x06) ? 0x02 : 0x01);
+        }
+        writeFrame(_fd, resp);
+      }
+    }
+
+    const int _fd;
+    std::atomic<bool> _stop { false };
+    std::thread _thread;
+};
+
+// Both ends raw, so frames pass unchanged
+struct Pty {
+  Pty() {
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    grantpt(master);
+    unlockpt(master);
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+  }
+  ~Pty() {
+    close(master);
+    close(slave);
+  }
+
+  int master;
+  int slave;
+};
+
+// Members in teardown order: the threads stop before the gateway and the
+// pty go
+struct Bench {
+  Bench(uint32_t gatewayTimeoutMs = 50, int linkTimeoutMs = 50)
+    : gateway(link, gatewayTimeoutMs, &lifetime), link(pty.master, linkTimeoutMs), slave(pty.slave) {
+    link.gateway = &gateway;
+  }
+  uint16_t forward(const std::vector<uint8_t>& request) {
+    return gateway.forward(Adu { request }, response, sizeof(response));
+  }
+
+  Pty pty;
+  Gateway gateway;
+  RtuLink link;
+  Slave slave;
+  uint8_t response[256];
+};
+
+void setUp() {
+  ttl = 0;
+}
+void tearDown() {}
+
+void test_read_forwarded_then_cached() {
+  ttl = 1000;
+  Bench bench;
+  const uint8_t expected[] = { 1, 0x03, 4, 0x10, 0x0A, 0x10, 0x0B };
+  TEST_ASSERT_EQUAL(sizeof(expected), bench.forward({ 1, 0x03, 0, 10, 0, 2 }));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, bench.response, sizeof(expected));
+  memset(bench.response, 0, sizeof(bench.response));
+  TEST_ASSERT_EQUAL(sizeof(expected), bench.forward({ 1, 0x03, 0, 10, 0, 2 }));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, bench.response, sizeof(expected));
+  TEST_ASSERT_EQUAL_UINT32(1, bench.slave.requests);
+  TEST_ASSERT_EQUAL_UINT32(1, bench.gateway.cache().hits);
+}
+
+void test_write_invalidates_cache() {
+  ttl = 1000;
+  Bench bench;
+  bench.forward({ 1, 0x03, 0, 10, 0, 1 });
+  TEST_ASSERT_EQUAL(6, bench.forward({ 1, 0x06, 0, 10, 0xBE, 0xEF }));
+  TEST_ASSERT_EQUAL(5, bench.forward({ 1, 0x03, 0, 10, 0, 1 }));
+  TEST_ASSERT_EQUAL_UINT8(0xBE, bench.response[3]);
+  TEST_ASSERT_EQUAL_UINT8(0xEF, bench.response[4]);
+  TEST_ASSERT_EQUAL_UINT32(3, bench.slave.requests);
+}
+
+void test_exception_passed_not_cached() {
+  ttl = 1000;
+  Bench bench;
+  for (int i = 0; i < 2; ++i) {
+    TEST_ASSERT_EQUAL(3, bench.forward({ 1, 0x03, 0, 30, 0, 4 }));
+    TEST_ASSERT_EQUAL_UINT8(0x83, bench.response[1]);
+    TEST_ASSERT_EQUAL_UINT8(0x02, bench.response[2]);
+  }
+  TEST_ASSERT_EQUAL_UINT32(2, bench.slave.requests);
+  TEST_ASSERT_EQUAL_UINT32(0, bench.gateway.failures);
+}
+
+void test_silent_slave_counts_failure() {
+  Bench bench;
+  bench.slave.silent = true;
+  TEST_ASSERT_EQUAL(0, bench.forward({ 1, 0x03, 0, 0, 0, 1 }));
+  TEST_ASSERT_EQUAL_UINT32(1, bench.gateway.failures);
+  bench.slave.silent = false;
+  TEST_ASSERT_EQUAL(5, bench.forward({ 1, 0x03, 0, 0, 0, 1 }));
+  TEST_ASSERT_EQUAL_UINT32(1, bench.gateway.failures);
+}
+
+// The gateway gives up (after 5 x 20 ms) before the slave answers: the
+// late answer must not land in the abandoned buffer nor in the next wait
+void test_late_answer_dropped() {
+  Bench bench(20, 400);
+  bench.slave.delayMs = 200;
+  memset(bench.response, 0xAA, sizeof(bench.response));
+  TEST_ASSERT_EQUAL(0, bench.forward({ 1, 0x03, 0, 1, 0, 1 }));
+  std::this_thread::sleep_for(std::chrono::milliseconds(200)); // Answered meanwhile
+  for (uint8_t b : bench.response) {
+    TEST_ASSERT_EQUAL_UINT8(0xAA, b);
+  }
+  bench.slave.delayMs = 0;
+  TEST_ASSERT_EQUAL(5, bench.forward({ 1, 0x03, 0, 2, 0, 1 }));
+  TEST_ASSERT_EQUAL_UINT8(0x10, bench.response[3]);
+  TEST_ASSERT_EQUAL_UINT8(0x02, bench.response[4]);
+}
+
+// As many callers as wait slots, each reading its own register: every
+// answer has to reach the caller that asked for it
+void test_concurrent_callers_get_own_answers() {
+  Bench bench(200);
+  std::atomic<uint32_t> wrong { 0 };
+  std::vector<std::thread> callers;
+  for (uint8_t c = 0; c < 4; ++c) {
+    callers.emplace_back([&bench, &wrong, c] {
+      uint8_t response[256];
+      for (uint8_t i = 0; i < 20; ++i) {
+        const uint8_t reg = c * 8 + i % 8;
+        const uint16_t len = bench.gateway.forward(Adu { { 1, 0x03, 0, reg, 0, 1 } }, response, sizeof(response));
+        if ((len != 5) || (response[4] != reg)) {
+          wrong += 1;
+        }
+      }
+    });
+  }
+  for (std::thread& t : callers) {
+    t.join();
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, wrong);
+  TEST_ASSERT_EQUAL_UINT32(80, bench.slave.requests);
+  TEST_ASSERT_EQUAL_UINT32(0, bench.gateway.failures);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_read_forwarded_then_cached);
+  RUN_TEST(test_write_invalidates_cache);
+  RUN_TEST(test_exception_passed_not_cached);
+  RUN_TEST(test_silent_slave_counts_failure);
+  RUN_TEST(test_late_answer_dropped);
+  RUN_TEST(test_concurrent_callers_get_own_answers);
+  return UNITY_END();
+}
@@ -0,0 +1,164 @@
+#include <unity.h>
+#include <PCF8574_KC868.hpp>
+#include <I2CBusMock.hpp>
+
+// PCF8574_KC868 with every transaction queued to an I2CEngine over
+// I2CBusMock: results only land when the owner applies the completions,
+// process() stands in for the engine task and the shim clock for millis()
+
+using Expanders = PCF8574_KC868<2, 2>;
+
+static const uint8_t addrIn[] = { 0x22, 0x21 };
+static const uint8_t addrOut[] = { 0x24, 0x25 };
+static const uint8_t INT_PIN = 35;
+
+struct Bench {
+  Bench() : engine(bus), io(addrIn, addrOut) {
+    for (uint8_t a : addrIn) {
+      bus.attach(a);
+    }
+    for (uint8_t a : addrOut) {
+      bus.attach(a);
+    }
+    io.attachEngine(&engine);
+  }
+  void run() { // Engine task drains the queue
+    while (engine.process()) {
+    }
+  }
+
+  I2CBusMock bus;
+  I2CEngine engine;
+  Expanders io;
+};
+
+static void advance(unsigned long ms) {
+  arduino_shim::state().now += ms * 1000;
+}
+
+void setUp() {
+  arduino_shim::state().now = 1000000;
+  arduino_shim::state().inputs[INT_PIN] = HIGH;
+}
+void tearDown() {}
+
+void test_output_written_on_completion() {
+  Bench b;
+  b.io.writeOutput(3, false);
+  TEST_ASSERT_EQUAL(0, b.io.flushOutput());
+  TEST_ASSERT_EQUAL(1, b.engine.pending());
+  TEST_ASSERT_EQUAL(0, b.io.flushOutput()); // Block in flight, not queued twice
+  TEST_ASSERT_EQUAL(1, b.engine.pending());
+  b.run();
+  TEST_ASSERT_EQUAL_UINT8(0xF7, b.bus.value[0x24]);
+  b.io.updateOutput();
+  TEST_ASSERT_EQUAL_UINT32(1, b.io.healthOut[0].ok);
+  b.io.flushOutput(); // Acknowledged, nothing left to write
+  TEST_ASSERT_EQUAL(0, b.engine.pending());
+}
+
+void test_output_changed_in_flight_is_reflushed() {
+  Bench b;
+  b.io.writeOutput(0, false);
+  b.io.flushOutput();
+  b.io.writeOutput(1, false); // While the first write is queued
+  b.run();
+  TEST_ASSERT_EQUAL_UINT8(0xFE, b.bus.value[0x24]);
+  b.io.updateOutput(); // Completion schedules the next flush
+  TEST_ASSERT_EQUAL(0, b.engine.pending());
+  advance(b.io.flushOutputDelay);
+  TEST_ASSERT_EQUAL(0, b.io.updateOutput());
+  b.run();
+  TEST_ASSERT_EQUAL_UINT8(0xFC, b.bus.value[0x24]);
+}
+
+void test_input_debounced_on_completion() {
+  Bench b;
+  b.bus.value[0x22] = 0xFE;
+  b.io.flushInput();
+  b.run();
+  TEST_ASSERT_TRUE(b.io.readInput(0)); // Not applied yet
+  b.io.updateInput();
+  TEST_ASSERT_FALSE(b.io.readInput(0));
+  TEST_ASSERT_EQUAL(0, b.io.events.size()); // First read primes the image
+
+  b.bus.value[0x21] = 0x7F;
+  b.io.flushInput();
+  b.run();
+  b.io.updateInput();
+  TEST_ASSERT_FALSE(b.io.readInput(15));
+  pcf8574_kc868::InputEvent e;
+  TEST_ASSERT_TRUE(b.io.events.pop(e));
+  TEST_ASSERT_EQUAL_UINT16(15, e.input);
+  TEST_ASSERT_FALSE(e.level);
+}
+
+// INT held low once the queued scan completes: an edge came in during the
+// scan, so the next updateInput() scans again at once
+void test_int_still_low_after_scan_rescans() {
+  Bench b;
+  b.io.enableInterrupt(INT_PIN);
+  TEST_ASSERT_EQUAL(0, b.io.updateInput()); // Dirty after enabling
+  TEST_ASSERT_EQUAL(2, b.engine.pending());
+  arduino_shim::state().inputs[INT_PIN] = LOW;
+  b.run();
+  TEST_ASSERT_EQUAL(0, b.io.updateInput());
+  TEST_ASSERT_EQUAL(2, b.engine.pending());
+
+  arduino_shim::state().inputs[INT_PIN] = HIGH;
+  b.run();
+  TEST_ASSERT_EQUAL(-1, b.io.updateInput());
+  TEST_ASSERT_EQUAL(0, b.engine.pending());
+  b.io.disableInterrupt();
+}
+
+// A failed read leaves INT to the safety poll, as in the synchronous path
+void test_int_not_rechecked_after_failed_scan() {
+  Bench b;
+  b.io.enableInterrupt(INT_PIN);
+  b.bus.detach(0x21);
+  b.io.updateInput();
+  arduino_shim::state().inputs[INT_PIN] = LOW;
+  b.run();
+  TEST_ASSERT_EQUAL(-1, b.io.updateInput());
+  TEST_ASSERT_EQUAL(0, b.engine.pending());
+  b.io.disableInterrupt();
+}
+
+void test_health_offline_then_back() {
+  Bench b;
+  b.bus.detach(0x25);
+  for (uint8_t i = 0; i < b.io.offlineAfterErrors; ++i) {
+    b.io.flushOutput(true);
+    b.run();
+    b.io.updateOutput();
+  }
+  TEST_ASSERT_FALSE(b.io.healthOut[1].online);
+  TEST_ASSERT_EQUAL_UINT32(3, b.io.healthOut[1].errors);
+  TEST_ASSERT_TRUE(b.io.healthOut[0].online);
+
+  b.io.flushOutput(true); // Backing off: not even queued
+  TEST_ASSERT_EQUAL(1, b.engine.pending());
+  b.run();
+  b.io.updateOutput();
+
+  b.bus.attach(0x25);
+  advance(b.io.backoffMin);
+  b.io.flushOutput(true);
+  b.run();
+  b.io.updateOutput();
+  TEST_ASSERT_TRUE(b.io.healthOut[1].online);
+  TEST_ASSERT_EQUAL(0, b.io.updateInput()); // Back online: begin() again
+  TEST_ASSERT_EQUAL(2 + 2 + 2, b.engine.pending()); // Input mode, outputs, first read
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_output_written_on_completion);
+  RUN_TEST(test_output_changed_in_flight_is_reflushed);
+  RUN_TEST(test_input_debounced_on_completion);
+  RUN_TEST(test_int_still_low_after_scan_rescans);
+  RUN_TEST(test_int_not_rechecked_after_failed_scan);
+  RUN_TEST(test_health_offline_then_back);
+  return UNITY_END();
+}
@@ -0,0 +1,250 @@
+#include <unity.h>
+#include <RCSwitch.h>
+#include <random>
+#include <vector>
+
+// Decoding from the edge ring against rc-switch 2.6.4 decoding in its ISR.
+// Edge captures (durations between level changes, as the receiver ISR
+// sees them) are synthesized from proto[] with jitter and bursts of
+// 433MHz noise, then replayed through the real ISR via the WProgram.h shim
+
+static const uint8_t N_PROTOCOLS = 12;
+
+struct Code {
+  unsigned long value;
+  unsigned int bitlength;
+  unsigned int delay;
+  unsigned int protocol;
+
+  bool operator==(const Code& o) const {
+    return (value == o.value) && (bitlength == o.bitlength) && (delay == o.delay) && (protocol == o.protocol);
+  }
+};
+
+// rc-switch 2.6.4 handleInterrupt()/receiveProtocol(), fed durations
+class ReferenceDecoder {
+  public:
+    void edge(unsigned int duration) {
+      if (duration > 4300) {
+        if ((repeatCount == 0) || (diff(duration, timings[0]) < 200)) {
+          repeatCount++;
+          if (repeatCount == 2) {
+            for (unsigned int i = 1; i <= N_PROTOCOLS; i++) {
+              if (receiveProtocol(i, changeCount)) {
+                break;
+              }
+            }
+            repeatCount = 0;
+          }
+        }
+        changeCount = 0;
+      }
+      if (changeCount >= RCSWITCH_MAX_CHANGES) {
+        changeCount = 0;
+        repeatCount = 0;
+      }
+      timings[changeCount++] = duration;
+    }
+
+    std::vector<Code> codes;
+  private:
+    static unsigned int diff(int a, int b) {
+      return abs(a - b);
+    }
+    bool receiveProtocol(const int p, unsigned int changeCount) {
+      if (changeCount <= 7) { // 2.6.4 checks after the loop, same outcome
+        return false;
+      }
+      RCSwitch::Protocol pro;
+      RCSwitch::getProtocol(p, pro);
+      unsigned long code = 0;
+      const unsigned int syncLengthInPulses = (pro.syncFactor.low > pro.syncFactor.high) ? pro.syncFactor.low : pro.syncFactor.high;
+      const unsigned int delay = timings[0] / syncLengthInPulses;
+      const unsigned int delayTolerance = delay * 60 / 100;
+      const unsigned int firstDataTiming = pro.invertedSignal ? 2 : 1;
+      for (unsigned int i = firstDataTiming; i < changeCount - 1; i += 2) {
+        code <<= 1;
+        if ((diff(timings[i], delay * pro.zero.high) < delayTolerance) &&
+            (diff(timings[i + 1], delay * pro.zero.low) < delayTolerance)) {
+          // zero
+        } else if ((diff(timings[i], delay * pro.one.high) < delayTolerance) &&
+                   (diff(timings[i + 1], delay * pro.one.low) < delayTolerance)) {
+          code |= 1;
+        } else {
+          return false;
+        }
+      }
+      if (code != 0) { // available() reports value 0 as nothing received
+        codes.push_back({ code, (changeCount - 1) / 2, delay, (unsigned int)p });
+      }
+      return true;
+    }
+
+    unsigned int timings[RCSWITCH_MAX_CHANGES] = {};
+    unsigned int changeCount = 0;
+    unsigned int repeatCount = 0;
+};
+
+class Capture {
+  public:
+    explicit Capture(uint32_t seed) : rng(seed) {}
+
+    // A remote sending code repeat times, after a quiet lead-in
+    void transmission(uint8_t protocol, unsigned long code, uint8_t bits, uint8_t repeat) {
+      RCSwitch::Protocol p;
+      RCSwitch::getProtocol(protocol, p);
+      edges.push_back(20000 + jitter());
+      for (uint8_t r = 0; r < repeat; ++r) {
+        for (int i = bits - 1; i >= 0; --i) {
+          pulse(p, (code & (1UL << i)) ? p.one : p.zero);
+        }
+        pulse(p, p.syncFactor);
+      }
+      edges.push_back(20000 + jitter());
+    }
+    // Superregenerative receiver output with no carrier: short random
+    // pulses, now and then a longer pause
+    void noise(size_t count) {
+      for (size_t i = 0; i < count; ++i) {
+        edges.push_back(((rng() % 16) == 0) ? 4300 + rng() % 12000 : 50 + rng() % 2000);
+      }
+    }
+
+    std::vector<unsigned int> edges;
+  private:
+    void pulse(const RCSwitch::Protocol& p, const RCSwitch::HighLow& hl) {
+      edges.push_back(p.pulseLength * hl.high + jitter());
+      edges.push_back(p.pulseLength * hl.low + jitter());
+    }
+    int jitter() {
+      return (int)(rng() % 81) - 40; // +-40us
+    }
+
+    std::mt19937 rng;
+};
+
+// Replays edges through the receiver ISR, decoding every chunk edges so
+// neither the edge ring nor the result queue can overflow
+static std::vector<Code> replay(RCSwitch& rc, const std::vector<unsigned int>& edges, size_t chunk) {
+  std::vector<Code> codes;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    arduino_shim::edge(edges[i]);
+    if (((i + 1) % chunk == 0) || (i + 1 == edges.size())) {
+      while (rc.available()) {
+        codes.push_back({ rc.getReceivedValue(), rc.getReceivedBitlength(), rc.getReceivedDelay(), rc.getReceivedProtocol() });
+        rc.resetAvailable();
+      }
+    }
+  }
+  return codes;
+}
+
+static std::vector<Code> reference(const std::vector<unsigned int>& edges) {
+  ReferenceDecoder ref;
+  for (unsigned int d : edges) {
+    ref.edge(d);
+  }
+  return ref.codes;
+}
+
+// Protocol 4's sync gap is shorter than nSeparationLimit and protocol 9
+// frames parse as protocol 8 (shifted by a bit): neither decodes in
+// rc-switch, in the reference as in the queued decoder
+static bool decodable(uint8_t protocol) {
+  return (protocol != 4) && (protocol != 9);
+}
+
+static bool found(const std::vector<Code>& codes, unsigned long value, unsigned int bits) {
+  for (const Code& c : codes) {
+    if ((c.value == value) && (c.bitlength == bits)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void setUp() {
+  arduino_shim::state().now = 0; // The ISR measures from 0 on a new RCSwitch
+}
+void tearDown() {}
+
+void test_every_protocol_decodes() {
+  for (uint8_t n = 1; n <= N_PROTOCOLS; ++n) {
+    Capture capture(n);
+    capture.transmission(n, 0xB3A51C, 24, 4);
+    RCSwitch rc;
+    rc.enableReceive(0);
+    const std::vector<Code> codes = replay(rc, capture.edges, 16);
+    TEST_ASSERT_TRUE(found(codes, 0xB3A51C, 24) == decodable(n));
+    TEST_ASSERT_TRUE(codes == reference(capture.edges));
+    rc.disableReceive();
+  }
+}
+
+void test_noisy_capture_matches_reference() {
+  Capture capture(433);
+  std::vector<unsigned long> sent;
+  for (uint32_t i = 0; i < 200; ++i) {
+    const uint8_t protocol = 1 + i % N_PROTOCOLS;
+    const unsigned long code = (0x10000UL + i * 7919UL) & 0xFFFFFF;
+    capture.noise(100 + (i % 7) * 50);
+    capture.transmission(protocol, code, 24, 3);
+    if (decodable(protocol)) {
+      sent.push_back(code);
+    }
+  }
+  capture.noise(200);
+  RCSwitch rc;
+  rc.enableReceive(0);
+  const std::vector<Code> codes = replay(rc, capture.edges, 16);
+  TEST_ASSERT_EQUAL_UINT32(0, rc.getLostEdges());
+  TEST_ASSERT_EQUAL_UINT32(0, rc.getLostCodes());
+  TEST_ASSERT_TRUE(codes == reference(capture.edges));
+  for (unsigned long code : sent) {
+    TEST_ASSERT_TRUE(found(codes, code, 24));
+  }
+  rc.disableReceive();
+}
+
+// Queued codes keep their own timings: protocols differ in sync length,
+// so timings[0] tells which frame a slot belongs to
+void test_rawdata_follows_each_code() {
+  Capture capture(7);
+  const uint8_t protocols[] = { 1, 2, 3, 5 };
+  for (uint8_t p : protocols) {
+    capture.transmission(p, 0x5A5A00 + p, 24, 3);
+  }
+  RCSwitch rc;
+  rc.enableReceive(0);
+  TEST_ASSERT_NULL(rc.getReceivedRawdata());
+  rc.setReceiveRawdata(true);
+  for (size_t i = 0; i < capture.edges.size(); ++i) {
+    arduino_shim::edge(capture.edges[i]);
+    if ((i % 16) == 15) {
+      rc.decode(); // Results stay queued
+    }
+  }
+  rc.decode();
+  TEST_ASSERT_EQUAL_UINT32(0, rc.getLostCodes());
+  for (uint8_t p : protocols) {
+    TEST_ASSERT_TRUE(rc.available());
+    TEST_ASSERT_EQUAL_UINT(p, rc.getReceivedProtocol());
+    RCSwitch::Protocol pro;
+    RCSwitch::getProtocol(p, pro);
+    const unsigned int* raw = rc.getReceivedRawdata();
+    TEST_ASSERT_NOT_NULL(raw);
+    const unsigned int sync = pro.pulseLength * ((pro.syncFactor.low > pro.syncFactor.high) ? pro.syncFactor.low : pro.syncFactor.high);
+    TEST_ASSERT_UINT_WITHIN(40, sync, raw[0]);
+    rc.resetAvailable();
+  }
+  TEST_ASSERT_FALSE(rc.available());
+  rc.disableReceive();
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_protocol_decodes);
+  RUN_TEST(test_noisy_capture_matches_reference);
+  RUN_TEST(test_rawdata_follows_each_code);
+  return UNITY_END();
+}
@@ -0,0 +1,108 @@
+#include <unity.h>
+#include <RCSwitch.h>
+#include <RCTransmitter.hpp>
+#include <vector>
+
+// rcEncodeFrame() against the proto[] table and against the pulse train
+// RCSwitch::send() bit-bangs (recorded by the WProgram.h shim)
+
+static const uint8_t N_PROTOCOLS = 12;
+
+// Symbols back to one level per entry, end marker dropped
+static std::vector<arduino_shim::Level> levels(const RCSymbol* frame, size_t n) {
+  std::vector<arduino_shim::Level> out;
+  for (size_t i = 0; i < n; ++i) {
+    out.push_back({ (int)frame[i].level0, frame[i].duration0 });
+    if (frame[i].duration1 != 0) {
+      out.push_back({ (int)frame[i].level1, frame[i].duration1 });
+    }
+  }
+  return out;
+}
+
+static bool pulseMatches(const arduino_shim::Level* l, const RCSwitch::Protocol& p, const RCSwitch::HighLow& hl) {
+  const int first = p.invertedSignal ? LOW : HIGH;
+  return (l[0].level == first) && (l[0].us == (unsigned long)p.pulseLength * hl.high) &&
+         (l[1].level != first) && (l[1].us == (unsigned long)p.pulseLength * hl.low);
+}
+
+void setUp() {
+  arduino_shim::state().trace.clear();
+}
+void tearDown() {}
+
+void test_every_protocol_matches_table() {
+  const uint32_t codes[] = { 0x000000, 0xFFFFFF, 0x5A5A5A, 0x123456 };
+  for (uint8_t n = 1; n <= N_PROTOCOLS; ++n) {
+    RCSwitch::Protocol p;
+    TEST_ASSERT_TRUE(RCSwitch::getProtocol(n, p));
+    for (uint32_t code : codes) {
+      RCSymbol frame[RC_TX_FRAME_SYMBOLS];
+      const size_t count = rcEncodeFrame(p, code, 24, frame, RC_TX_FRAME_SYMBOLS);
+      TEST_ASSERT_EQUAL(25, count); // 24 bits + sync, one symbol each
+      const std::vector<arduino_shim::Level> l = levels(frame, count);
+      TEST_ASSERT_EQUAL(50, l.size());
+      for (int bit = 0; bit < 24; ++bit) {
+        const bool one = code & (1UL << (23 - bit));
+        TEST_ASSERT_TRUE(pulseMatches(&l[bit * 2], p, one ? p.one : p.zero));
+      }
+      TEST_ASSERT_TRUE(pulseMatches(&l[48], p, p.syncFactor));
+    }
+  }
+}
+
+void test_same_train_as_bit_banged_send() {
+  for (uint8_t n = 1; n <= N_PROTOCOLS; ++n) {
+    RCSwitch rc;
+    rc.enableTransmit(4);
+    rc.setRepeatTransmit(1);
+    rc.setProtocol(n);
+    arduino_shim::state().trace.clear();
+    rc.send(0xA5C3F, 20);
+    const std::vector<arduino_shim::Level> sent = arduino_shim::state().trace;
+
+    RCSwitch::Protocol p;
+    RCSwitch::getProtocol(n, p);
+    RCSymbol frame[RC_TX_FRAME_SYMBOLS];
+    const std::vector<arduino_shim::Level> encoded = levels(frame, rcEncodeFrame(p, 0xA5C3F, 20, frame, RC_TX_FRAME_SYMBOLS));
+    TEST_ASSERT_EQUAL(sent.size(), encoded.size());
+    for (size_t i = 0; i < sent.size(); ++i) {
+      TEST_ASSERT_EQUAL_INT(sent[i].level, encoded[i].level);
+      TEST_ASSERT_EQUAL_UINT32(sent[i].us, encoded[i].us);
+    }
+  }
+}
+
+void test_long_levels_are_split() {
+  RCSwitch::Protocol p;
+  RCSwitch::getProtocol(1, p);
+  p.pulseLength = 2000; // Sync low 31 * 2000us, over the 15 bit RMT field
+  RCSymbol frame[RC_TX_FRAME_SYMBOLS];
+  const size_t count = rcEncodeFrame(p, 0x5, 4, frame, RC_TX_FRAME_SYMBOLS);
+  TEST_ASSERT_GREATER_THAN(5, count);
+  const std::vector<arduino_shim::Level> l = levels(frame, count);
+  unsigned long low = 0;
+  for (size_t i = 9; i < l.size(); ++i) { // After the sync high
+    TEST_ASSERT_EQUAL_INT(LOW, l[i].level);
+    TEST_ASSERT_LESS_OR_EQUAL(RC_TX_MAX_TICKS, l[i].us);
+    low += l[i].us;
+  }
+  TEST_ASSERT_EQUAL_UINT32(31UL * 2000, low);
+}
+
+void test_frame_too_long_is_refused() {
+  RCSwitch::Protocol p;
+  RCSwitch::getProtocol(1, p);
+  RCSymbol frame[8];
+  TEST_ASSERT_EQUAL(0, rcEncodeFrame(p, 0xFFFFFF, 24, frame, 8));
+  TEST_ASSERT_EQUAL(8, rcEncodeFrame(p, 0x7F, 7, frame, 8));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_protocol_matches_table);
+  RUN_TEST(test_same_train_as_bit_banged_send);
+  RUN_TEST(test_long_levels_are_split);
+  RUN_TEST(test_frame_too_long_is_refused);
+  return UNITY_END();
+}
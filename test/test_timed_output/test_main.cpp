@@ -0,0 +1,178 @@
+#include <unity.h>
+#include <TimedOutput.hpp>
+#include <vector>
+
+// Timer wheel behaviour over a recording sink: firing order within a
+// tick, retriggers and delays longer than one wheel turn
+
+struct Write {
+  uint16_t output;
+  bool value;
+};
+
+struct Sink {
+  bool state[16] = {};
+  std::vector<Write> writes;
+  uint32_t flushes = 0;
+
+  void writeOutput(uint16_t n, bool value) {
+    state[n] = value;
+    writes.push_back({ n, value });
+  }
+  void flushOutput() {
+    flushes += 1;
+  }
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_pulse() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  TEST_ASSERT_TRUE(timers.pulse(3, 10));
+  TEST_ASSERT_TRUE(sink.state[3]);
+  timers.update(9);
+  TEST_ASSERT_TRUE(sink.state[3]);
+  TEST_ASSERT_EQUAL(1, timers.update(10));
+  TEST_ASSERT_FALSE(sink.state[3]);
+  TEST_ASSERT_EQUAL(0, timers.pending());
+}
+
+// Steps due on the same tick fire in the order they were scheduled
+void test_same_tick_keeps_order() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  const timed_output::Step steps[] = {
+    { 1, true, 5 },
+    { 1, false, 0 },
+    { 2, false, 3 },
+    { 2, true, 0 },
+  };
+  TEST_ASSERT_TRUE(timers.sequence(steps, 4));
+  timers.update(8);
+  TEST_ASSERT_FALSE(sink.state[1]);
+  TEST_ASSERT_TRUE(sink.state[2]);
+  TEST_ASSERT_EQUAL(4, sink.writes.size());
+  TEST_ASSERT_EQUAL_UINT16(1, sink.writes[0].output);
+  TEST_ASSERT_TRUE(sink.writes[0].value);
+  TEST_ASSERT_FALSE(sink.writes[1].value);
+  TEST_ASSERT_EQUAL_UINT16(2, sink.writes[2].output);
+  TEST_ASSERT_FALSE(sink.writes[2].value);
+  TEST_ASSERT_TRUE(sink.writes[3].value);
+}
+
+void test_retrigger_extends_pulse() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  timers.pulse(4, 10);
+  timers.update(6);
+  timers.pulse(4, 10); // Retriggered: off at 16, not 10
+  timers.update(12);
+  TEST_ASSERT_TRUE(sink.state[4]);
+  timers.update(16);
+  TEST_ASSERT_FALSE(sink.state[4]);
+  TEST_ASSERT_EQUAL(0, timers.pending());
+}
+
+void test_cancel_keeps_other_outputs() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  timers.onDelay(5, 4);
+  timers.onDelay(6, 4);
+  timers.onDelay(7, 4);
+  timers.cancel(6);
+  timers.onDelay(8, 4); // Appended after the cancelled one
+  timers.update(4);
+  TEST_ASSERT_TRUE(sink.state[5]);
+  TEST_ASSERT_FALSE(sink.state[6]);
+  TEST_ASSERT_TRUE(sink.state[7]);
+  TEST_ASSERT_TRUE(sink.state[8]);
+  TEST_ASSERT_EQUAL(3, sink.writes.size());
+  TEST_ASSERT_EQUAL_UINT16(8, sink.writes[2].output);
+}
+
+// A sequence leaves several timers on one output, all of them go
+void test_cancel_drops_every_step_of_output() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  const timed_output::Step steps[] = {
+    { 2, true, 3 },
+    { 3, true, 0 },
+    { 2, false, 3 },
+    { 2, true, 20 }, // Next wheel turn
+  };
+  TEST_ASSERT_TRUE(timers.sequence(steps, 4));
+  timers.cancel(2);
+  TEST_ASSERT_EQUAL(1, timers.pending());
+  timers.update(40);
+  TEST_ASSERT_EQUAL(1, sink.writes.size());
+  TEST_ASSERT_EQUAL_UINT16(3, sink.writes[0].output);
+  TEST_ASSERT_EQUAL(8, timers.available());
+}
+
+void test_output_out_of_range_refused() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16, 16> timers(sink);
+  timers.begin(0);
+  TEST_ASSERT_FALSE(timers.onDelay(16, 5));
+  const timed_output::Step steps[] = { { 1, true, 1 }, { 16, true, 1 } };
+  TEST_ASSERT_FALSE(timers.sequence(steps, 2));
+  TEST_ASSERT_EQUAL(0, timers.pending());
+  timers.cancel(16);
+}
+
+void test_delay_over_wheel_turns() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  timers.onDelay(9, 40); // Two and a half turns of a 16 slot wheel
+  timers.update(39);
+  TEST_ASSERT_FALSE(sink.state[9]);
+  timers.update(40);
+  TEST_ASSERT_TRUE(sink.state[9]);
+}
+
+void test_fired_writes_flush_once() {
+  Sink sink;
+  TimedOutput<Sink, 8, 16> timers(sink);
+  timers.begin(0);
+  timers.offDelay(1, 2);
+  timers.offDelay(2, 3);
+  timers.offDelay(3, 3);
+  timers.update(5);
+  TEST_ASSERT_EQUAL_UINT32(1, sink.flushes);
+  timers.update(6);
+  TEST_ASSERT_EQUAL_UINT32(1, sink.flushes);
+}
+
+void test_full_pool_refuses() {
+  Sink sink;
+  TimedOutput<Sink, 2, 16> timers(sink);
+  timers.begin(0);
+  TEST_ASSERT_TRUE(timers.onDelay(1, 5));
+  TEST_ASSERT_TRUE(timers.onDelay(2, 5));
+  TEST_ASSERT_FALSE(timers.onDelay(3, 5));
+  TEST_ASSERT_EQUAL_UINT32(1, timers.overflows);
+  const timed_output::Step steps[] = { { 4, true, 1 } };
+  TEST_ASSERT_FALSE(timers.sequence(steps, 1));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pulse);
+  RUN_TEST(test_same_tick_keeps_order);
+  RUN_TEST(test_retrigger_extends_pulse);
+  RUN_TEST(test_cancel_keeps_other_outputs);
+  RUN_TEST(test_cancel_drops_every_step_of_output);
+  RUN_TEST(test_output_out_of_range_refused);
+  RUN_TEST(test_delay_over_wheel_turns);
+  RUN_TEST(test_fired_writes_flush_once);
+  RUN_TEST(test_full_pool_refuses);
+  return UNITY_END();
+}